@@ -3,7 +3,9 @@
 #include <time.h> /* time_t, struct tm, time, gmtime */
 #include <unistd.h>
 #include <algorithm>
+#include <array>
 #include <atomic>
+#include <cmath>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
@@ -11,8 +13,13 @@
 #include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <random>
+#include <set>
+#include <shared_mutex>
 #include <sstream>
 #include <string>
 #include <thread>
@@ -39,6 +46,28 @@ constexpr bool LOAD_LIKES_INDEX = true;
 
 constexpr int32_t REBUILD_TIMEOUT_MS = 1200;  // 1.2s
 
+// group queries without filters up to that many keys are read from pre-sorted views
+constexpr int32_t SORTED_GROUP_VIEW_MAX_KEYS = 2;
+
+// cubes (precomputed group results) are materialized in order until they take that much
+constexpr int32_t GROUP_CUBES_MEMORY_BUDGET_MB = 300;
+// cubes with only one of city and country are summed up from the cube with both of them,
+// false materializes them as well to answer such queries without the rollup
+constexpr bool ROLLUP_CITY_COUNTRY_CUBES = true;
+// optional profile of group queries ("count<TAB>fields" lines, see GroupShapeStats),
+// cubes of the most frequent shapes are materialized first.
+// Rewritten with the shapes seen since start on every rebuild of indexes.
+constexpr const char* GROUP_PROFILE_FILE = "group_profile.txt";
+
+// cached groups are updated by a background thread, writes only append to its log
+constexpr bool ASYNC_GROUP_UPDATES = true;
+
+constexpr bool ENABLE_QUERY_CACHE = true;
+constexpr int32_t QUERY_CACHE_MAX_SIZE = 200000;
+// recommend and suggest responses, invalidated by changes of accounts they depend on
+constexpr bool ENABLE_RESULT_CACHE = true;
+constexpr int32_t RESULT_CACHE_MAX_SIZE = 200000;
+
 // constexpr int LOGGING_LEVEL = INFO_LEVEL;
 // constexpr int LOGGING_LEVEL = ERROR_LEVEL;
 
@@ -56,6 +85,8 @@ constexpr bool RANDOM_RECOMMEND_RATE = 0;
 
 constexpr bool ENABLE_MEMORY_CHECKING = false;
 constexpr int NUM_CONCURRENT_REQUESTS = 4;
+// extra threads to run heavy queries (full scans) in parallel
+constexpr int NUM_SCAN_WORKERS = 3;
 
 constexpr bool USE_FAST_HTTP_SERVER = false;
 constexpr bool JSON_FAST_DUMP = true;
@@ -74,6 +105,7 @@ constexpr bool DEBUG_MEMORY_LEAK = false;
 constexpr int RANDOM_RECOMMEND_RATE = 0;
 constexpr bool ENABLE_MEMORY_CHECKING = false;
 constexpr int NUM_CONCURRENT_REQUESTS = 1;
+constexpr int NUM_SCAN_WORKERS = 3;
 
 // constexpr bool USE_FAST_HTTP_SERVER = true;
 constexpr bool USE_FAST_HTTP_SERVER = false;
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Log of items applied by a background thread in batches, so that writers only append to it.
+// Every pushed item gets an epoch (its number), readers that need the applied state wait
+// until the epoch they've seen is applied.
+template <class T>
+class BatchApplier {
+   public:
+    using ApplyBatch = std::function<void(std::vector<T>& batch)>;
+
+    explicit BatchApplier(ApplyBatch applyBatch)
+        : _applyBatch(std::move(applyBatch)), _thread(&BatchApplier::applierLoop, this) {}
+
+    BatchApplier(const BatchApplier&) = delete;
+    BatchApplier& operator=(const BatchApplier&) = delete;
+
+    ~BatchApplier() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _hasPending.notify_all();
+        _thread.join();
+    }
+
+    // returns epoch of the item
+    int64_t push(T item) {
+        int64_t epoch;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _pending.push_back(std::move(item));
+            epoch = ++_pushedEpoch;
+        }
+        _hasPending.notify_one();
+        return epoch;
+    }
+
+    // blocks until all items pushed up to epoch are applied
+    void waitApplied(int64_t epoch) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _applied.wait(lock, [&] { return _appliedEpoch >= epoch; });
+    }
+
+    // blocks until all items pushed before the call are applied
+    void waitAllApplied() {
+        int64_t epoch;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_appliedEpoch == _pushedEpoch) {
+                return;
+            }
+            epoch = _pushedEpoch;
+        }
+        waitApplied(epoch);
+    }
+
+   private:
+    void applierLoop() {
+        std::vector<T> batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _hasPending.wait(lock, [&] { return _stopping || !_pending.empty(); });
+                if (_pending.empty()) {
+                    // stopping
+                    return;
+                }
+                batch.swap(_pending);
+            }
+
+            _applyBatch(batch);
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _appliedEpoch += batch.size();
+            }
+            _applied.notify_all();
+            batch.clear();
+        }
+    }
+
+    ApplyBatch _applyBatch;
+
+    std::mutex _mutex;
+    std::condition_variable _hasPending;
+    std::condition_variable _applied;
+    std::vector<T> _pending;
+    int64_t _pushedEpoch{0};
+    int64_t _appliedEpoch{0};
+    bool _stopping{false};
+
+    // should be the last one, it uses the fields above
+    std::thread _thread;
+};
@@ -26,6 +26,43 @@ bool checkIfFieldIsPresent(const std::string& field, const std::string& boolValu
     return checkBooleanValue(field.empty(), boolValue);
 }
 
+// "1" selects accounts from the list, "0" selects all the other accounts
+std::unique_ptr<IdIterator> createBooleanIterator(const IndexStorage* index,
+                                                  const AccountIdList& list,
+                                                  const std::string& boolValue) {
+    if (boolValue == "1") {
+        return std::make_unique<IdListIterator>(list);
+    } else {
+        return createComplementIterator(index, &list);
+    }
+}
+
+// same as checkIfFieldIsPresent but for the list of accounts with non-empty field
+std::unique_ptr<IdIterator> createNullValueIterator(const IndexStorage* index,
+                                                    const AccountIdList& withField,
+                                                    const std::string& boolValue) {
+    if (boolValue == "1") {
+        return createComplementIterator(index, &withField);
+    } else {
+        return std::make_unique<IdListIterator>(withField);
+    }
+}
+
+// matches are called non-virtually for the whole block of candidates
+#define IMPLEMENT_FILTER_BLOCK(FilterType)                       \
+    int32_t filterBlock(AccountId* ids, int32_t size) override { \
+        MY_ASSERT(index);                                        \
+        const auto& accountsArray = index->accountsArray;        \
+        int32_t selected = 0;                                    \
+        for (int32_t i = 0; i < size; ++i) {                     \
+            auto id = ids[i];                                    \
+            if (FilterType::matches(id, accountsArray[id])) {    \
+                ids[selected++] = id;                            \
+            }                                                    \
+        }                                                        \
+        return selected;                                         \
+    }
+
 struct Filter {
     std::string name;
     const IndexStorage* index{nullptr};
@@ -41,6 +78,10 @@ struct Filter {
                                                     const IndexStorage& index);
     virtual bool matches(AccountId accountId, const AccountData& data) = 0;
 
+    // keeps only matching ids in the block (order is preserved), returns new size of the block
+    // see IMPLEMENT_FILTER_BLOCK
+    virtual int32_t filterBlock(AccountId* ids, int32_t size) = 0;
+
     virtual bool supportsLookup() { return false; }
 
     virtual int32_t estimateOutputSize() {
@@ -60,6 +101,9 @@ struct Filter {
 
     // this method is only for fields that are used in group filter
     virtual int32_t getValueId() const { return INVALID_ID; }
+
+    // matching accounts as a bitmap if there is one (see IndexStorage::bitmapsAtSex)
+    virtual const AccountBitmap* getBitmap() const { return nullptr; }
 };
 
 struct SexFilter : public Filter {
@@ -76,6 +120,8 @@ struct SexFilter : public Filter {
         return result;
     }
 
+    IMPLEMENT_FILTER_BLOCK(SexFilter)
+
     bool matches(AccountId accountId, const AccountData& data) override {
         return data.sex == value;
     }
@@ -87,6 +133,11 @@ struct SexFilter : public Filter {
     }
 
     int32_t getValueId() const override { return static_cast<int32_t>(convertStringToSex(value)); }
+
+    const AccountBitmap* getBitmap() const override {
+        MY_ASSERT(index);
+        return &index->bitmapsAtSex[getValueId()];
+    }
 };
 
 struct EmailFilter : public Filter {
@@ -98,9 +149,11 @@ struct EmailFilter : public Filter {
 
     Predicate predicate;
     std::string value;
+    EmailDomainId emailDomainId{INVALID_ID};
 
     static std::unique_ptr<Filter> parsePredicate(const std::string& predicate,
-                                                  const std::string& value) {
+                                                  const std::string& value,
+                                                  const IndexStorage& index) {
         auto result = std::make_unique<EmailFilter>();
         if (predicate == "lt") {
             result->predicate = Predicate::LT;
@@ -111,6 +164,7 @@ struct EmailFilter : public Filter {
         } else if (predicate == "domain") {
             result->predicate = Predicate::DOMAIN_VALUE;
             result->value = value;
+            result->emailDomainId = index.emailDomainIdMap.getId(value);
         } else {
             THROW_ERROR("EmailFilter -> Unexpected predicate: " + predicate);
         }
@@ -125,16 +179,19 @@ struct EmailFilter : public Filter {
     }
 
     std::unique_ptr<IdIterator> findRemainingItems() override {
-        RETURN_ITERATOR_FROM_MAP(usersAtEmailDomain, value);
+        MY_ASSERT(index);
+        return createIteratorFromIntIndex(index->usersAtEmailDomainId, emailDomainId);
     }
 
+    IMPLEMENT_FILTER_BLOCK(EmailFilter)
+
     bool matches(AccountId accountId, const AccountData& data) override {
         if (predicate == Predicate::LT) {
             return data.email < value;
         } else if (predicate == Predicate::GT) {
             return data.email > value;
         } else if (predicate == Predicate::DOMAIN_VALUE) {
-            return data.emailDomain == value;
+            return data.emailDomainId == emailDomainId;
         } else {
             MY_ASSERT(false);
         }
@@ -164,6 +221,8 @@ struct StatusFilter : public Filter {
         return result;
     }
 
+    IMPLEMENT_FILTER_BLOCK(StatusFilter)
+
     bool matches(AccountId accountId, const AccountData& data) override {
         if (predicate == Predicate::EQ) {
             return data.status == value;
@@ -174,19 +233,27 @@ struct StatusFilter : public Filter {
         }
     }
 
-    bool supportsLookup() override {
-        if (predicate == Predicate::EQ) {
-            return true;
-        }
-        return false;
-    }
+    bool supportsLookup() override { return true; }
 
     std::unique_ptr<IdIterator> findRemainingItems() override {
         MY_ASSERT(index);
-        return std::make_unique<IdListIterator>(index->usersAtStatus[static_cast<int8_t>(value)]);
+        const auto& list = index->usersAtStatus[static_cast<int8_t>(value)];
+        if (predicate == Predicate::EQ) {
+            return std::make_unique<IdListIterator>(list);
+        } else {
+            return createComplementIterator(index, &list);
+        }
     }
 
     int32_t getValueId() const override { return static_cast<int32_t>(value); }
+
+    const AccountBitmap* getBitmap() const override {
+        MY_ASSERT(index);
+        if (predicate != Predicate::EQ) {
+            return nullptr;
+        }
+        return &index->bitmapsAtStatus[getValueId()];
+    }
 };
 
 struct FNameFilter : public Filter {
@@ -198,18 +265,28 @@ struct FNameFilter : public Filter {
 
     Predicate predicate;
     std::string value;
-    std::unordered_set<std::string> values;
+
+    FNameId fnameId{INVALID_ID};
+    std::unordered_set<FNameId> fnameIds;
 
     static std::unique_ptr<Filter> parsePredicate(const std::string& predicate,
-                                                  const std::string& value) {
+                                                  const std::string& value,
+                                                  const IndexStorage& index) {
         auto result = std::make_unique<FNameFilter>();
         if (predicate == "eq") {
             result->predicate = Predicate::EQ;
             result->value = value;
+            result->fnameId = index.fnameIdMap.getId(value);
         } else if (predicate == "any") {
             result->predicate = Predicate::ANY;
             auto names = splitString(value, ',');
-            result->values.insert(names.begin(), names.end());
+            for (const auto& name : names) {
+                auto fnameId = index.fnameIdMap.getId(name);
+                // unknown names can't match anything
+                if (fnameId != INVALID_ID) {
+                    result->fnameIds.insert(fnameId);
+                }
+            }
         } else if (predicate == "null") {
             result->predicate = Predicate::NULL_VALUE;
             validateBooleanValue(value);
@@ -220,17 +297,36 @@ struct FNameFilter : public Filter {
         return result;
     }
 
+    IMPLEMENT_FILTER_BLOCK(FNameFilter)
+
     bool matches(AccountId accountId, const AccountData& data) override {
         if (predicate == Predicate::EQ) {
-            return data.fname == value;
+            return data.fnameId == fnameId;
         } else if (predicate == Predicate::ANY) {
-            return stl::contains(values, data.fname);
+            return stl::contains(fnameIds, data.fnameId);
         } else if (predicate == Predicate::NULL_VALUE) {
             return checkIfFieldIsPresent(data.fname, value);
         } else {
             MY_ASSERT(false);
         }
     }
+
+    bool supportsLookup() override { return true; }
+
+    std::unique_ptr<IdIterator> findRemainingItems() override {
+        MY_ASSERT(index);
+        if (predicate == Predicate::EQ) {
+            return createIteratorFromIntIndex(index->usersAtFNameId, fnameId);
+        } else if (predicate == Predicate::ANY) {
+            std::vector<std::unique_ptr<IdIterator>> iterators;
+            for (auto id : fnameIds) {
+                iterators.push_back(createIteratorFromIntIndex(index->usersAtFNameId, id));
+            }
+            return std::make_unique<UnionIdIterator>(std::move(iterators));
+        }
+        MY_ASSERT(predicate == Predicate::NULL_VALUE);
+        return createNullValueIterator(index, index->usersWithFName, value);
+    }
 };
 
 struct SNameFilter : public Filter {
@@ -260,6 +356,8 @@ struct SNameFilter : public Filter {
         return result;
     }
 
+    IMPLEMENT_FILTER_BLOCK(SNameFilter)
+
     bool matches(AccountId accountId, const AccountData& data) override {
         if (predicate == Predicate::EQ) {
             return data.sname == value;
@@ -271,6 +369,14 @@ struct SNameFilter : public Filter {
             MY_ASSERT(false);
         }
     }
+
+    bool supportsLookup() override { return predicate == Predicate::NULL_VALUE; }
+
+    std::unique_ptr<IdIterator> findRemainingItems() override {
+        MY_ASSERT(index);
+        MY_ASSERT(predicate == Predicate::NULL_VALUE);
+        return createNullValueIterator(index, index->usersWithSName, value);
+    }
 };
 
 struct PhoneFilter : public Filter {
@@ -281,13 +387,16 @@ struct PhoneFilter : public Filter {
 
     Predicate predicate;
     std::string value;
+    PhoneCodeId phoneCodeId{INVALID_ID};
 
     static std::unique_ptr<Filter> parsePredicate(const std::string& predicate,
-                                                  const std::string& value) {
+                                                  const std::string& value,
+                                                  const IndexStorage& index) {
         auto result = std::make_unique<PhoneFilter>();
         result->value = value;
         if (predicate == "code") {
             result->predicate = Predicate::CODE;
+            result->phoneCodeId = index.phoneCodeIdMap.getId(value);
         } else if (predicate == "null") {
             result->predicate = Predicate::NULL_VALUE;
             validateBooleanValue(value);
@@ -297,15 +406,28 @@ struct PhoneFilter : public Filter {
         return result;
     }
 
+    IMPLEMENT_FILTER_BLOCK(PhoneFilter)
+
     bool matches(AccountId accountId, const AccountData& data) override {
         if (predicate == Predicate::CODE) {
-            return getPhoneCode(data.phone) == value;
+            return data.phoneCodeId == phoneCodeId;
         } else if (predicate == Predicate::NULL_VALUE) {
             return checkIfFieldIsPresent(data.phone, value);
         } else {
             MY_ASSERT(false);
         }
     }
+
+    bool supportsLookup() override { return true; }
+
+    std::unique_ptr<IdIterator> findRemainingItems() override {
+        MY_ASSERT(index);
+        if (predicate == Predicate::CODE) {
+            return createIteratorFromIntIndex(index->usersAtPhoneCodeId, phoneCodeId);
+        }
+        MY_ASSERT(predicate == Predicate::NULL_VALUE);
+        return createNullValueIterator(index, index->usersWithPhone, value);
+    }
 };
 
 struct CountryFilter : public Filter {
@@ -338,6 +460,8 @@ struct CountryFilter : public Filter {
         return result;
     }
 
+    IMPLEMENT_FILTER_BLOCK(CountryFilter)
+
     bool matches(AccountId accountId, const AccountData& data) override {
         if (predicate == Predicate::EQ) {
             return data.countryId == countryId;
@@ -349,14 +473,9 @@ struct CountryFilter : public Filter {
     }
 
     bool supportsLookup() override {
-        if (predicate == Predicate::EQ) {
+        if (predicate == Predicate::EQ || predicate == Predicate::NULL_VALUE) {
             return true;
         }
-        if (predicate == Predicate::NULL_VALUE) {
-            if (value == "1") {
-                return true;
-            }
-        }
         return false;
     }
 
@@ -366,15 +485,24 @@ struct CountryFilter : public Filter {
         if (predicate == Predicate::EQ) {
             RETURN_ITERATOR_FROM_MAP(usersAtCountry, value)
         }
-        if (predicate == Predicate::NULL_VALUE) {
-            if (value == "1") {
-                RETURN_ITERATOR_FROM_MAP(usersAtCountry, "");
-            }
+        MY_ASSERT(predicate == Predicate::NULL_VALUE);
+        if (value == "1") {
+            RETURN_ITERATOR_FROM_MAP(usersAtCountry, "");
+        } else {
+            return createComplementIterator(index, stl::mapGetPtr(index->usersAtCountry, ""));
         }
-        MY_ASSERT(false);
     }
 
     int32_t getValueId() const override { return countryId; }
+
+    const AccountBitmap* getBitmap() const override {
+        MY_ASSERT(index);
+        if (predicate != Predicate::EQ || countryId < 0 ||
+            countryId >= index->bitmapsAtCountryId.size()) {
+            return nullptr;
+        }
+        return &index->bitmapsAtCountryId[countryId];
+    }
 };
 
 struct CityFilter : public Filter {
@@ -414,6 +542,8 @@ struct CityFilter : public Filter {
         return result;
     }
 
+    IMPLEMENT_FILTER_BLOCK(CityFilter)
+
     bool matches(AccountId accountId, const AccountData& data) override {
         if (predicate == Predicate::EQ) {
             return data.cityId == cityId;
@@ -427,14 +557,9 @@ struct CityFilter : public Filter {
     }
 
     bool supportsLookup() override {
-        if (predicate == Predicate::EQ) {
+        if (predicate == Predicate::EQ || predicate == Predicate::NULL_VALUE) {
             return true;
         }
-        if (predicate == Predicate::NULL_VALUE) {
-            if (value == "1") {
-                return true;
-            }
-        }
         return false;
     }
 
@@ -444,12 +569,12 @@ struct CityFilter : public Filter {
         if (predicate == Predicate::EQ) {
             RETURN_ITERATOR_FROM_MAP(usersAtCity, value)
         }
-        if (predicate == Predicate::NULL_VALUE) {
-            if (value == "1") {
-                RETURN_ITERATOR_FROM_MAP(usersAtCity, "");
-            }
+        MY_ASSERT(predicate == Predicate::NULL_VALUE);
+        if (value == "1") {
+            RETURN_ITERATOR_FROM_MAP(usersAtCity, "");
+        } else {
+            return createComplementIterator(index, stl::mapGetPtr(index->usersAtCity, ""));
         }
-        MY_ASSERT(false);
     }
 
     int32_t getValueId() const override { return cityId; }
@@ -484,6 +609,8 @@ struct BirthFilter : public Filter {
         return result;
     }
 
+    IMPLEMENT_FILTER_BLOCK(BirthFilter)
+
     bool matches(AccountId accountId, const AccountData& data) override {
         if (predicate == Predicate::LT) {
             return data.birth < value;
@@ -530,6 +657,8 @@ struct JoinedFilter : public Filter {
         return result;
     }
 
+    IMPLEMENT_FILTER_BLOCK(JoinedFilter)
+
     bool matches(AccountId accountId, const AccountData& data) override {
         return data.joinedYear == year;
     }
@@ -575,6 +704,8 @@ struct InterestsFilter : public Filter {
         return result;
     }
 
+    IMPLEMENT_FILTER_BLOCK(InterestsFilter)
+
     bool matches(AccountId accountId, const AccountData& data) override {
         // 1 values optimization
         if (valuesVec.size() == 1) {
@@ -708,6 +839,8 @@ struct LikesFilter : public Filter {
         return result;
     }
 
+    IMPLEMENT_FILTER_BLOCK(LikesFilter)
+
     bool matches(AccountId accountId, const AccountData& data) override {
         // std::cout << "trying to match with account " << accountId << std::endl;
         int idx1 = 0;
@@ -751,13 +884,8 @@ struct LikesFilter : public Filter {
         return true;
     }
 
-    bool supportsLookup() override {
-        // NOTE: fix rewrite query if increasing number of values supported
-        if (values.size() <= 3) {
-            return true;
-        }
-        return false;
-    }
+    bool supportsLookup() override { return true; }
+
     std::unique_ptr<IdIterator> createSingleValueIterator(AccountId id) {
         if (isValidId(id) && isValidId(index->accountsArray[id].id)) {
             return std::make_unique<LikeEdgeIterator>(index->accountsArray[id].backwardLikes);
@@ -770,18 +898,13 @@ struct LikesFilter : public Filter {
         MY_ASSERT(index);
         if (values.size() == 1) {
             return createSingleValueIterator(values[0]);
-        } else if (values.size() == 2) {
-            auto a = createSingleValueIterator(values[0]);
-            auto b = createSingleValueIterator(values[1]);
-            return std::make_unique<IntersectionIdIterator>(std::move(a), std::move(b));
-        } else {
-            MY_ASSERT(values.size() == 3);
-            auto a = createSingleValueIterator(values[0]);
-            auto b = createSingleValueIterator(values[1]);
-            auto c = createSingleValueIterator(values[2]);
-            auto it1 = std::make_unique<IntersectionIdIterator>(std::move(a), std::move(b));
-            return std::make_unique<IntersectionIdIterator>(std::move(it1), std::move(c));
         }
+        std::vector<std::unique_ptr<IdIterator>> iterators;
+        iterators.reserve(values.size());
+        for (auto id : values) {
+            iterators.push_back(createSingleValueIterator(id));
+        }
+        return std::make_unique<MultiIntersectionIdIterator>(std::move(iterators));
     }
 };
 
@@ -811,6 +934,8 @@ struct PremiumFilter : public Filter {
         return result;
     }
 
+    IMPLEMENT_FILTER_BLOCK(PremiumFilter)
+
     bool matches(AccountId accountId, const AccountData& data) override {
         if (predicate == Predicate::NOW) {
             return checkBooleanValue(data.hasPremiumNow, value);
@@ -820,6 +945,24 @@ struct PremiumFilter : public Filter {
             MY_ASSERT(false);
         }
     }
+
+    bool supportsLookup() override { return true; }
+
+    std::unique_ptr<IdIterator> findRemainingItems() override {
+        MY_ASSERT(index);
+        if (predicate == Predicate::NOW) {
+            return createBooleanIterator(index, index->usersWithPremiumNow, value);
+        } else {
+            return createNullValueIterator(index, index->usersWithPremium, value);
+        }
+    }
+
+    int32_t getValueId() const override {
+        if (predicate == Predicate::NOW) {
+            return value == "1" ? 1 : 0;
+        }
+        return INVALID_ID;
+    }
 };
 
 std::unique_ptr<Filter> Filter::parseSelector(const std::string& field,
@@ -829,15 +972,15 @@ std::unique_ptr<Filter> Filter::parseSelector(const std::string& field,
     if (field == "sex") {
         result = SexFilter::parsePredicate(predicate, value);
     } else if (field == "email") {
-        result = EmailFilter::parsePredicate(predicate, value);
+        result = EmailFilter::parsePredicate(predicate, value, index);
     } else if (field == "status") {
         result = StatusFilter::parsePredicate(predicate, value);
     } else if (field == "fname") {
-        result = FNameFilter::parsePredicate(predicate, value);
+        result = FNameFilter::parsePredicate(predicate, value, index);
     } else if (field == "sname") {
         result = SNameFilter::parsePredicate(predicate, value);
     } else if (field == "phone") {
-        result = PhoneFilter::parsePredicate(predicate, value);
+        result = PhoneFilter::parsePredicate(predicate, value, index);
     } else if (field == "country") {
         result = CountryFilter::parsePredicate(predicate, value, index);
     } else if (field == "city") {
@@ -868,7 +1011,7 @@ std::unique_ptr<Filter> Filter::parseGroupFilter(const std::string& field, const
     } else if (field == "status") {
         result = StatusFilter::parsePredicate("eq", value);
     } else if (field == "fname") {
-        result = FNameFilter::parsePredicate("eq", value);
+        result = FNameFilter::parsePredicate("eq", value, index);
     } else if (field == "sname") {
         result = SNameFilter::parsePredicate("eq", value);
     } else if (field == "phone") {
@@ -886,7 +1029,8 @@ std::unique_ptr<Filter> Filter::parseGroupFilter(const std::string& field, const
     } else if (field == "likes") {
         result = LikesFilter::parsePredicate("contains", value);
     } else if (field == "premium") {
-        throw UnsupportedException("Filter by premium in group API is unsupported");
+        // premium is active now (it is a breakdown of cached groups as well)
+        result = PremiumFilter::parsePredicate("now", value);
     } else {
         THROW_ERROR("Unexpected field: " + field);
     }
@@ -961,13 +1105,18 @@ struct LocationFilter {
         if (!country.empty() && !city.empty()) {
             THROW_ERROR("LocationFilter ->  Both city and country filters are present");
         }
+        std::unique_ptr<Filter> result;
         if (!country.empty()) {
-            return CountryFilter::parsePredicate("eq", country, index);
-        }
-        if (!city.empty()) {
-            return CityFilter::parsePredicate("eq", city, index);
+            result = CountryFilter::parsePredicate("eq", country, index);
+            result->name = "country";
+        } else if (!city.empty()) {
+            result = CityFilter::parsePredicate("eq", city, index);
+            result->name = "city";
+        } else {
+            return nullptr;
         }
-        return nullptr;
+        result->index = &index;
+        return result;
     }
 };
 
@@ -981,6 +1130,17 @@ struct OptimizedFilter {
         return true;
     }
 
+    // applies filters one by one to the whole block, returns number of matching ids left
+    int32_t filterBlock(AccountId* ids, int32_t size) {
+        for (const auto& filter : filters) {
+            if (size == 0) {
+                break;
+            }
+            size = filter->filterBlock(ids, size);
+        }
+        return size;
+    }
+
     std::unique_ptr<Filter> lookupFilter;
     std::vector<std::unique_ptr<Filter>> filters;
 };
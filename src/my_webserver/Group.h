@@ -7,12 +7,14 @@
 
 struct GroupField {
     GroupField(GroupFieldType groupFieldType_, const std::string& name_, const IndexStorage& index_)
-        : name(name_), index(index_), type(groupFieldType_) {}
+        : name(name_), index(index_), type(groupFieldType_), mask(getGroupFieldMask(name_)) {}
     const IndexStorage& index;
     std::string name;
 
     // is only really used to get string value for sorting
     GroupFieldType type;
+    // addresses cached groups, see getGroupFieldMask
+    GroupFieldMask mask;
 
     virtual ~GroupField() = default;
 
@@ -25,18 +27,20 @@ struct GroupField {
 
     virtual bool hasSingleValue() const { return true; }
     virtual GroupValue getValue(const AccountData& data) = 0;
-    virtual std::vector<GroupValue> getValues(const AccountData& data) {
+    // multi-value fields are iterated by position to avoid building a vector per account
+    virtual int32_t getNumValues(const AccountData& data) {
+        // Shouldn't be called except when overriden
+        MY_ASSERT(false);
+    }
+    virtual GroupValue getValueAt(const AccountData& data, int32_t position) {
         // Shouldn't be called except when overriden
         MY_ASSERT(false);
     }
 
+    // map should be initialized with this field only
     void updateWithValue(GroupValue value, int32_t size, GroupAggregationMap* map) const {
         if (size > 0) {
-            GroupAggregationItem empty;
-            GroupAggregationItem item(empty, value);
-            item.count = size;
-            const auto& key = item.getKey();
-            (*map)[key] = std::move(item);
+            map->insert(appendGroupValue(0, value), size);
         }
     }
 };
@@ -66,18 +70,15 @@ struct InterestField : public GroupField {
     }
 
     bool hasSingleValue() const override { return false; }
-    std::vector<GroupValue> getValues(const AccountData& data) override {
-        std::vector<GroupValue> result;
-        result.reserve(data.interests.size());
-        for (const auto& interestId : data.interests) {
-            if (interestId >= index.interestIdMap.size()) {
-                std::cout << "Unexpected interestId: " << interestId
-                          << " max = " << index.interestIdMap.size() << std::endl;
-                MY_ASSERT(false);
-            }
-            result.emplace_back(interestId, type);
+    int32_t getNumValues(const AccountData& data) override { return data.interests.size(); }
+    GroupValue getValueAt(const AccountData& data, int32_t position) override {
+        auto interestId = data.interests[position];
+        if (interestId >= index.interestIdMap.size()) {
+            std::cout << "Unexpected interestId: " << interestId
+                      << " max = " << index.interestIdMap.size() << std::endl;
+            MY_ASSERT(false);
         }
-        return result;
+        return GroupValue{interestId, type};
     }
 };
 
@@ -112,6 +113,14 @@ struct JoinedField : public GroupField {
     }
 };
 
+struct PremiumField : public GroupField {
+    using GroupField::GroupField;
+
+    GroupValue getValue(const AccountData& data) override {
+        return GroupValue{data.hasPremiumNow, type};
+    }
+};
+
 // struct LikesField : public GroupField {
 //     using GroupField::GroupField;
 //
@@ -156,6 +165,8 @@ std::unique_ptr<GroupField> GroupField::parseExtendedField(const std::string& na
         return std::make_unique<BirthField>(GroupFieldType::FAKE, name, index);
     } else if (name == "joined") {
         return std::make_unique<JoinedField>(GroupFieldType::FAKE, name, index);
+    } else if (name == "premium") {
+        return std::make_unique<PremiumField>(GroupFieldType::PREMIUM, name, index);
         // } else if (name == "likes") {
         //     return std::make_unique<LikesField>(GroupFieldType::FAKE, name, index);
     } else {
@@ -163,6 +174,47 @@ std::unique_ptr<GroupField> GroupField::parseExtendedField(const std::string& na
     }
 }
 
+// adds counts of partial map (e.g. computed by another thread) into map
+// both maps should be initialized with the same fields
+void mergeGroupAggregationMap(GroupAggregationMap& map, const GroupAggregationMap& partial) {
+    partial.forEach([&](GroupKey key, int32_t count) {
+        auto countPtr = map.find(key);
+        if (countPtr) {
+            *countPtr += count;
+        } else {
+            map.insert(key, count);
+        }
+    });
+}
+
+// Change of cached groups by a single account, the account data only has the fields
+// group fields depend on (see copyGroupFields).
+struct GroupDelta {
+    AccountData data;
+    int32_t delta;
+};
+
+AccountData copyGroupFields(const AccountData& data) {
+    AccountData result;
+    result.id = data.id;
+    result.interests = data.interests;
+    result.hasPremiumNow = data.hasPremiumNow;
+    result.status = data.status;
+    result.joinedYear = data.joinedYear;
+    result.birthYear = data.birthYear;
+    result.countryId = data.countryId;
+    result.cityId = data.cityId;
+    result.sexEnum = data.sexEnum;
+    return result;
+}
+
+// e.g. updates of email or phone don't change cached groups
+bool haveSameGroupFields(const AccountData& a, const AccountData& b) {
+    return a.interests == b.interests && a.hasPremiumNow == b.hasPremiumNow &&
+           a.status == b.status && a.joinedYear == b.joinedYear && a.birthYear == b.birthYear &&
+           a.countryId == b.countryId && a.cityId == b.cityId && a.sexEnum == b.sexEnum;
+}
+
 class GroupList {
    public:
     static std::unique_ptr<GroupList> parse(const RequestParams& params,
@@ -210,33 +262,40 @@ class GroupList {
         return result;
     }
 
+    // map keys follow current order of groupFields
+    void initMap(GroupAggregationMap& map) const {
+        std::vector<GroupFieldType> types;
+        types.reserve(groupFields.size());
+        for (const auto& field : groupFields) {
+            types.push_back(field->type);
+        }
+        map.init(types);
+    }
+
     void updateMap(const AccountData& data, GroupAggregationMap& map, int delta) const {
-        GroupAggregationItem item;
-        updateMapImpl(0, item, data, map, delta);
+        forEachKey(data, [&](GroupKey key) { map.add(key, delta); });
     }
 
-    void updateMapImpl(int32_t index, const GroupAggregationItem& item, const AccountData& data,
-                       GroupAggregationMap& map, int delta) const {
+    // f(GroupKey key) is called for every group the account belongs to
+    template <class Function>
+    void forEachKey(const AccountData& data, Function&& f) const {
+        forEachKeyImpl(0, 0, data, f);
+    }
+
+    template <class Function>
+    void forEachKeyImpl(int32_t index, GroupKey key, const AccountData& data, Function& f) const {
         if (index == groupFields.size()) {
-            const auto& key = item.getKey();
-            auto valuePtr = stl::mapGetPtr(map, key);
-            if (valuePtr) {
-                valuePtr->count += delta;
-                return;
-            }
-            // we set new items only when delta is positive
-            MY_ASSERT(delta > 0);
-            map[key] = item;
+            f(key);
         } else {
             const auto& field = groupFields[index];
             if (field->hasSingleValue()) {
-                const auto& value = field->getValue(data);
-                GroupAggregationItem newItem(item, value);
-                updateMapImpl(index + 1, newItem, data, map, delta);
+                auto newKey = appendGroupValue(key, field->getValue(data));
+                forEachKeyImpl(index + 1, newKey, data, f);
             } else {
-                for (const auto& value : field->getValues(data)) {
-                    GroupAggregationItem newItem(item, value);
-                    updateMapImpl(index + 1, newItem, data, map, delta);
+                int32_t numValues = field->getNumValues(data);
+                for (int32_t i = 0; i < numValues; ++i) {
+                    auto newKey = appendGroupValue(key, field->getValueAt(data, i));
+                    forEachKeyImpl(index + 1, newKey, data, f);
                 }
             }
         }
@@ -253,83 +312,58 @@ class GroupList {
 
     int groupFieldsSize() const { return groupFields.size(); }
 
-    // used to get canonical key of the result operation
-    // see getCacheKey2D
+    // used to get canonical order of fields of the cached groups
     void sortGroupFields() {
         std::sort(groupFields.begin(), groupFields.end(),
-                  [](const auto& a, const auto& b) { return a->getName() < b->getName(); });
-    }
-
-    std::string getCacheKey4D() const {
-        MY_ASSERT_EQ(groupFields.size(), 4);
-        return groupFields[0]->getName() + "," + groupFields[1]->getName() + "," +
-               groupFields[2]->getName() + "," + groupFields[3]->getName();
-    }
-
-    std::string getCacheKey3D() const {
-        MY_ASSERT_EQ(groupFields.size(), 3);
-        return groupFields[0]->getName() + "," + groupFields[1]->getName() + "," +
-               groupFields[2]->getName();
+                  [](const auto& a, const auto& b) { return a->mask < b->mask; });
     }
 
-    std::string getCacheKey2D() const {
-        MY_ASSERT_EQ(groupFields.size(), 2);
-        return groupFields[0]->getName() + "," + groupFields[1]->getName();
+    GroupFieldMask getFieldsMask() const {
+        GroupFieldMask result = 0;
+        for (const auto& field : groupFields) {
+            result |= field->mask;
+        }
+        return result;
     }
 
-    std::string getCacheKey1D() const {
-        MY_ASSERT_EQ(groupFields.size(), 1);
-        return groupFields[0]->getName();
+    // fields of keys and filters together, that's the cached group the query could be served by
+    // returns 0 if some of the filters is not a group field (e.g. likes)
+    GroupFieldMask getCombinedFieldsMask() const {
+        GroupFieldMask result = getFieldsMask();
+        for (const auto& filter : filters) {
+            auto fieldMask = getGroupFieldMask(filter->name);
+            if (!fieldMask) {
+                return 0;
+            }
+            result |= fieldMask;
+        }
+        return result;
     }
 
-    std::string getCacheKeyGenericD() const {
-        if (groupFields.size() == 1) {
-            return getCacheKey1D();
-        } else if (groupFields.size() == 2) {
-            return getCacheKey2D();
-        } else if (groupFields.size() == 3) {
-            return getCacheKey3D();
-        } else {
-            std::cout << "size " << groupFields.size() << " is not suppoted" << std::endl;
-            MY_ASSERT(false);
+    // comma separated names of fields, only used for logging and explain API
+    std::string getFieldNames() const {
+        std::string result;
+        for (const auto& field : groupFields) {
+            result += (result.empty() ? "" : ",") + field->getName();
         }
+        return result;
     }
 
     GroupAggregationMap* getCachedGroupResult(IndexStorage& index) const {
-        return index.getCachedGroupResult(getCacheKeyGenericD(), groupFieldsSize());
+        return index.getCachedGroupResult(getFieldsMask());
     }
 
     void createCachedGroup(IndexStorage& index) const {
-        int size = groupFieldsSize();
-        auto& cachedGroup = index.getCachedGroup(size);
-        cachedGroup[getCacheKeyGenericD()] = GroupAggregationMap();
-    }
-
-    void getCombinedCacheKey(std::string& combinedKey, int& size) const {
-        std::unordered_set<std::string> allNames;
-        for (const auto& groupField : groupFields) {
-            allNames.insert(groupField->getName());
-        }
-        for (const auto& filter : filters) {
-            allNames.insert(filter->name);
-        }
-        size = allNames.size();
-
-        std::vector<std::string> namesVec(allNames.begin(), allNames.end());
-        std::sort(namesVec.begin(), namesVec.end());
-
-        combinedKey = namesVec[0];
-        for (int i = 1; i < namesVec.size(); ++i) {
-            combinedKey += ',';
-            combinedKey += namesVec[i];
-        }
+        auto& cachedGroup = index.cachedGroups[getFieldsMask()];
+        cachedGroup = std::make_unique<GroupAggregationMap>();
+        initMap(*cachedGroup);
     }
 
-    // returns index of field in groupFields vector
+    // returns index of filter in filters vector
     // -1 otherwise
-    int findMatchingGroupField(const std::string& name) const {
-        for (int i = 0; i < groupFields.size(); ++i) {
-            if (groupFields[i]->getName() == name) {
+    int findMatchingFilter(const std::string& name) const {
+        for (int i = 0; i < filters.size(); ++i) {
+            if (filters[i]->name == name) {
                 return i;
             }
         }
@@ -347,3 +381,115 @@ class GroupList {
     // original order in which fields came (needed for sorting)
     std::vector<GroupFieldType> groupFieldTypes;
 };
+
+// Number of group queries by their combined fields (see GroupList::getCombinedFieldsMask).
+// Dumped as a profile that is read on the next start to choose which cubes to materialize.
+class GroupShapeStats {
+   public:
+    void record(GroupFieldMask mask) { ++_counts[mask]; }
+
+    // "count<TAB>fields" lines, most frequent first, returns number of lines
+    int32_t dump(std::ostream& out) const {
+        std::vector<std::pair<int64_t, GroupFieldMask>> shapes;
+        for (GroupFieldMask mask = 1; mask < _counts.size(); ++mask) {
+            if (_counts[mask] > 0) {
+                shapes.emplace_back(_counts[mask], mask);
+            }
+        }
+        SORT_REVERSE(shapes);
+        for (const auto& [count, mask] : shapes) {
+            out << count << "\t" << getGroupFieldNames(mask) << std::endl;
+        }
+        return shapes.size();
+    }
+
+   private:
+    std::array<std::atomic<int64_t>, 1 << NUM_GROUP_FIELD_BITS> _counts{};
+};
+
+// Non-empty groups of a cached map ordered the way group API sorts them for one order of keys.
+// It is maintained on every update of the map, so group queries without filters only read
+// first limit entries from either end instead of copying and sorting the whole map.
+// Like the map, it is updated under the exclusive lock of cached groups and read under the
+// shared one, see Server::cachedGroupsMutex.
+class SortedGroupView {
+   public:
+    static constexpr int32_t MAX_VIEW_KEYS = 3;
+
+    struct Entry {
+        int32_t count;
+        // ranks of the values in the order of query keys
+        std::array<int32_t, MAX_VIEW_KEYS> ranks;
+        GroupKey key;
+
+        bool operator<(const Entry& other) const {
+            return std::tie(count, ranks, key) < std::tie(other.count, other.ranks, other.key);
+        }
+    };
+
+    // order - types of query keys, map should have the same fields in any order
+    SortedGroupView(const GroupAggregationMap* map_, const std::vector<GroupFieldType>& order)
+        : map(map_) {
+        MY_ASSERT(order.size() <= MAX_VIEW_KEYS);
+        const auto& types = map->getTypes();
+        for (auto groupType : order) {
+            auto it = std::find(types.begin(), types.end(), groupType);
+            MY_ASSERT(it != types.end());
+            positions.push_back(it - types.begin());
+        }
+    }
+
+    // should be called after ranks are rebuilt
+    void build(const IndexStorage& index) {
+        entries.clear();
+        valid = true;
+        map->forEach([&](GroupKey key, int32_t count) { update(key, 0, count, index); });
+    }
+
+    void update(GroupKey key, int32_t oldCount, int32_t newCount, const IndexStorage& index) {
+        if (!valid || oldCount == newCount) {
+            return;
+        }
+        Entry entry{oldCount, {}, key};
+        for (int32_t i = 0; i < positions.size(); ++i) {
+            if (!getGroupValueRank(map->getValue(key, positions[i]), index, &entry.ranks[i])) {
+                // value was added after the last rebuild, wait for the next one
+                valid = false;
+                entries.clear();
+                return;
+            }
+        }
+        if (oldCount > 0) {
+            entries.erase(entry);
+        }
+        if (newCount > 0) {
+            entry.count = newCount;
+            entries.insert(entry);
+        }
+    }
+
+    // f(GroupKey key, int32_t count) returns false to stop
+    // Returns false if the view is invalid, f is not called then.
+    template <class Function>
+    bool forEachInOrder(bool increasingOrder, Function&& f) const {
+        if (!valid) {
+            return false;
+        }
+        if (increasingOrder) {
+            for (auto it = entries.begin(); it != entries.end() && f(it->key, it->count); ++it) {
+            }
+        } else {
+            for (auto it = entries.rbegin(); it != entries.rend() && f(it->key, it->count); ++it) {
+            }
+        }
+        return true;
+    }
+
+    const GroupAggregationMap* getMap() const { return map; }
+
+   private:
+    const GroupAggregationMap* map;
+    std::vector<int32_t> positions;
+    std::set<Entry> entries;
+    bool valid{false};
+};
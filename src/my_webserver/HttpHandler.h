@@ -99,6 +99,14 @@ class HttpHandler : public CivetHandler {
             GET_REQUEST_PARAMS(params);
             processGroup(conn, params);
             return true;
+        } else if (uri == "/accounts/filter/explain/") {
+            GET_REQUEST_PARAMS(params);
+            processExplain(conn, params, /* isGroup */ false);
+            return true;
+        } else if (uri == "/accounts/group/explain/") {
+            GET_REQUEST_PARAMS(params);
+            processExplain(conn, params, /* isGroup */ true);
+            return true;
         } else {
             auto parts = splitString(uri, '/');
             if (parts.size() >= 5) {
@@ -195,20 +203,27 @@ class HttpHandler : public CivetHandler {
             return;
         }
 
+        auto cacheKey = QueryCache::getKey("recommend/" + std::to_string(accountId), params);
+        std::string body;
+        if (_server->resultCache.get(cacheKey, _server->resultVersions, &body)) {
+            replyWithCode(conn, 200, body);
+            return;
+        }
+        auto writeSeq = _server->resultVersions.getWriteSeq();
+
         json j;
+        ResultDependencies dependencies;
         try {
             int32_t limit = extractLimitParam(params);
-            _server->recommendAPI(j, accountId, limit, params);
+            _server->recommendAPI(j, accountId, limit, params, &dependencies);
         } catch (std::runtime_error& e) {
             MY_LOG(INFO_LEVEL, "Got error: \"" << e.what() << "\" while processing recommend API");
             replyWithCode(conn, 400, "");
             return;
         }
-        if (JSON_FAST_DUMP) {
-            replyWithCode(conn, 200, j.dump());
-        } else {
-            replyWithCode(conn, 200, j.dump(4));
-        }
+        body = dumpResponse(j);
+        _server->resultCache.put(cacheKey, writeSeq, dependencies, _server->resultVersions, body);
+        replyWithCode(conn, 200, body);
     }
 
     void processSuggest(mg_connection* conn, AccountId accountId, const RequestParams& params) {
@@ -219,23 +234,38 @@ class HttpHandler : public CivetHandler {
             replyWithCode(conn, 404, "");
             return;
         }
+        auto cacheKey = QueryCache::getKey("suggest/" + std::to_string(accountId), params);
+        std::string body;
+        if (_server->resultCache.get(cacheKey, _server->resultVersions, &body)) {
+            replyWithCode(conn, 200, body);
+            return;
+        }
+        auto writeSeq = _server->resultVersions.getWriteSeq();
+
         json j;
+        ResultDependencies dependencies;
         try {
             int32_t limit = extractLimitParam(params);
-            _server->suggestAPI(j, accountId, limit, params);
+            _server->suggestAPI(j, accountId, limit, params, &dependencies);
         } catch (std::runtime_error& e) {
             MY_LOG(INFO_LEVEL, "Got error: \"" << e.what() << "\" while processing suggest API");
             replyWithCode(conn, 400, "");
             return;
         }
-        if (JSON_FAST_DUMP) {
-            replyWithCode(conn, 200, j.dump());
-        } else {
-            replyWithCode(conn, 200, j.dump(4));
-        }
+        body = dumpResponse(j);
+        _server->resultCache.put(cacheKey, writeSeq, dependencies, _server->resultVersions, body);
+        replyWithCode(conn, 200, body);
     }
 
     void processFilter(mg_connection* conn, const RequestParams& params) {
+        auto cacheKey = QueryCache::getKey("filter", params);
+        auto epoch = _server->writeEpoch.load();
+        std::string body;
+        if (_server->queryCache.get(cacheKey, epoch, &body)) {
+            replyWithCode(conn, 200, body);
+            return;
+        }
+
         json j;
         try {
             int32_t limit = extractLimitParam(params);
@@ -243,15 +273,22 @@ class HttpHandler : public CivetHandler {
         } catch (std::runtime_error& e) {
             MY_LOG(INFO_LEVEL, "Got error: \"" << e.what() << "\" while processing filter API");
             replyWithCode(conn, 400, "");
+            return;
         }
-        if (JSON_FAST_DUMP) {
-            replyWithCode(conn, 200, j.dump());
-        } else {
-            replyWithCode(conn, 200, j.dump(4));
-        }
+        body = dumpResponse(j);
+        _server->queryCache.put(cacheKey, epoch, body);
+        replyWithCode(conn, 200, body);
     }
 
     void processGroup(mg_connection* conn, const RequestParams& params) {
+        auto cacheKey = QueryCache::getKey("group", params);
+        auto epoch = _server->writeEpoch.load();
+        std::string body;
+        if (_server->queryCache.get(cacheKey, epoch, &body)) {
+            replyWithCode(conn, 200, body);
+            return;
+        }
+
         // construct response
         // std::vector<AccountId> ids;
         json j;
@@ -262,14 +299,40 @@ class HttpHandler : public CivetHandler {
             MY_LOG(ERROR_LEVEL,
                    "UnsupportedException: \"" << e.what() << "\" while processing group API");
             replyWithCode(conn, 400, "");
+            return;
         } catch (std::runtime_error& e) {
             MY_LOG(INFO_LEVEL, "Got error: \"" << e.what() << "\" while processing group API");
             replyWithCode(conn, 400, "");
+            return;
+        }
+        body = dumpResponse(j);
+        _server->queryCache.put(cacheKey, epoch, body);
+        replyWithCode(conn, 200, body);
+    }
+
+    // never cached, runs the query and replies with its plan
+    void processExplain(mg_connection* conn, const RequestParams& params, bool isGroup) {
+        json j;
+        try {
+            int32_t limit = extractLimitParam(params);
+            if (isGroup) {
+                _server->groupExplainAPI(j, params, limit);
+            } else {
+                _server->filterExplainAPI(j, params, limit);
+            }
+        } catch (std::runtime_error& e) {
+            MY_LOG(INFO_LEVEL, "Got error: \"" << e.what() << "\" while processing explain API");
+            replyWithCode(conn, 400, "");
+            return;
         }
+        replyWithCode(conn, 200, dumpResponse(j));
+    }
+
+    static std::string dumpResponse(const json& j) {
         if (JSON_FAST_DUMP) {
-            replyWithCode(conn, 200, j.dump());
+            return j.dump();
         } else {
-            replyWithCode(conn, 200, j.dump(4));
+            return j.dump(4);
         }
     }
 
@@ -35,7 +35,32 @@ class IdValueMap {
 
     size_t size() const { return _idToValueMap.size(); }
 
+    // rank is position of the value in sorted order of all values,
+    // so ranks compare the same way as values do
+    void buildRanks() {
+        std::vector<TId> ids(_idToValueMap.size());
+        for (size_t i = 0; i < ids.size(); ++i) {
+            ids[i] = i;
+        }
+        std::sort(ids.begin(), ids.end(),
+                  [&](TId a, TId b) { return _idToValueMap[a] < _idToValueMap[b]; });
+        _ranks.assign(ids.size(), 0);
+        for (size_t i = 0; i < ids.size(); ++i) {
+            _ranks[ids[i]] = i;
+        }
+    }
+
+    // values created after the last buildRanks() don't have rank
+    bool getRank(TId id, int32_t* rank) const {
+        if (id < 0 || id >= _ranks.size()) {
+            return false;
+        }
+        *rank = _ranks[id];
+        return true;
+    }
+
    private:
     std::unordered_map<TValue, TId> _valueToIdMap;
     std::vector<TValue> _idToValueMap;
+    std::vector<int32_t> _ranks;
 };
@@ -59,10 +59,16 @@ class IndexLoader {
 
         buildListOfEmails();
 
+        loadGroupProfile(GROUP_PROFILE_FILE);
         precomputeGroups(&_groupListAll);
-        precomputeGroupResults(_groupListAll);
+        precomputeGroupResults(&_groupListAll);
+        buildInterestCooccurrence();
+        createSortedGroupViews();
 
+        buildValueRanks();
+        buildSortedGroupViews();
         buildSingleValueIndexes();
+        buildValueBitmaps();
         buildRecommendIndex();
         // should be called after all data is built
         // e.g. backwardLikes
@@ -76,7 +82,11 @@ class IndexLoader {
         // NOTE: not rebuilding group index
         // relying on incremental update
         MY_LOG_WITH_MEMORY("Rebuilding indexes");
+        buildValueRanks();
+        // ranks are changed
+        buildSortedGroupViews();
         buildSingleValueIndexes();
+        buildValueBitmaps();
         buildRecommendIndex();
         sortAccountData();
         MY_LOG_WITH_MEMORY("Rebuilding indexes finished");
@@ -142,123 +152,330 @@ class IndexLoader {
         }
     }
 
+    // Cubes go from the most to the least useful ones,
+    // precomputeGroupResults keeps them in that order while they fit into the memory budget.
     void precomputeGroups(std::vector<GroupList>* groupListAll) {
         groupListAll->clear();
 
         MY_LOG_WITH_MEMORY("Precomputing group results");
 #define REGULAR_GROUP_FIELDS() "sex", "status", "country", "city", "interests"
+#define EXTENDED_GROUP_FIELDS() "joined", "birth", "premium"
+        // extended fields can only be used in filters
         std::vector<std::string> names = {REGULAR_GROUP_FIELDS()};
-        std::vector<std::string> namesWithYears = {REGULAR_GROUP_FIELDS(), "joined", "birth"};
-        std::vector<std::string> yearsOnly = {"joined", "birth"};
-        // std::vector<std::string> namesAll = {REGULAR_GROUP_FIELDS(), "joined", "birth", "likes"};
+        std::vector<std::string> namesExtended = {REGULAR_GROUP_FIELDS(), EXTENDED_GROUP_FIELDS()};
+        std::vector<std::string> extendedOnly = {EXTENDED_GROUP_FIELDS()};
 
-        for (int i = 0; i < names.size(); ++i) {
-            const auto& name = names[i];
+        auto addGroupList = [&](const std::vector<std::string>& regular,
+                                const std::vector<std::string>& extended) {
             GroupList groupList;
             auto& groupFields = groupList.groupFields;
-            groupFields.push_back(GroupField::parseField(name, index));
-            // std::cout << "  running for 1 keys=" << name << std::endl;
-
+            for (const auto& name : regular) {
+                groupFields.push_back(GroupField::parseField(name, index));
+            }
+            for (const auto& name : extended) {
+                groupFields.push_back(GroupField::parseExtendedField(name, index));
+            }
+            groupList.sortGroupFields();
             groupListAll->push_back(std::move(groupList));
+        };
+
+        for (int i = 0; i < names.size(); ++i) {
+            addGroupList({names[i]}, {});
         }
 
         for (int i1 = 0; i1 < names.size(); ++i1) {
-            for (int i2 = i1 + 1; i2 < namesWithYears.size(); ++i2) {
-                GroupList groupList;
-                auto& groupFields = groupList.groupFields;
-                groupFields.push_back(GroupField::parseField(names[i1], index));
-                groupFields.push_back(GroupField::parseExtendedField(namesWithYears[i2], index));
-                groupList.sortGroupFields();
+            for (int i2 = i1 + 1; i2 < namesExtended.size(); ++i2) {
+                addGroupList({names[i1]}, {namesExtended[i2]});
+            }
+        }
+
+        for (int i1 = 0; i1 < names.size(); ++i1) {
+            for (int i2 = i1 + 1; i2 < names.size(); ++i2) {
+                for (int i3 = i2 + 1; i3 < namesExtended.size(); ++i3) {
+                    addGroupList({names[i1], names[i2]}, {namesExtended[i3]});
+                }
+            }
+        }
 
-                // std::cout << "  running for 2 keys=" << names[i1] << "," << names[i2]
-                //           << std::endl;
-                groupListAll->push_back(std::move(groupList));
+        // 4D: two group keys with two filters are the most common
+        for (int i1 = 0; i1 < names.size(); ++i1) {
+            for (int i2 = i1 + 1; i2 < names.size(); ++i2) {
+                for (int i3 = 0; i3 < extendedOnly.size(); ++i3) {
+                    for (int i4 = i3 + 1; i4 < extendedOnly.size(); ++i4) {
+                        addGroupList({names[i1], names[i2]}, {extendedOnly[i3], extendedOnly[i4]});
+                    }
+                }
             }
         }
 
         for (int i1 = 0; i1 < names.size(); ++i1) {
             for (int i2 = i1 + 1; i2 < names.size(); ++i2) {
-                for (int i3 = i2 + 1; i3 < namesWithYears.size(); ++i3) {
-                    GroupList groupList;
-                    auto& groupFields = groupList.groupFields;
-                    groupFields.push_back(GroupField::parseField(names[i1], index));
-                    groupFields.push_back(GroupField::parseField(names[i2], index));
-                    groupFields.push_back(
-                        GroupField::parseExtendedField(namesWithYears[i3], index));
-                    groupList.sortGroupFields();
-
-                    // std::cout << "  running for 3 keys=" << names[i1] << "," << names[i2]
-                    //           << std::endl;
-                    groupListAll->push_back(std::move(groupList));
+                for (int i3 = i2 + 1; i3 < names.size(); ++i3) {
+                    for (int i4 = i3 + 1; i4 < namesExtended.size(); ++i4) {
+                        addGroupList({names[i1], names[i2], names[i3]}, {namesExtended[i4]});
+                    }
                 }
             }
         }
+#undef REGULAR_GROUP_FIELDS
+#undef EXTENDED_GROUP_FIELDS
 
-        // for (int i1 = 0; i1 < names.size(); ++i1) {
-        //     for (int i2 = i1 + 1; i2 < names.size(); ++i2) {
-        //         for (int i3 = i2 + 1; i3 < names.size(); ++i3) {
-        //             for (int i4 = 0; i4 < yearsOnly.size(); ++i4) {
-        //                 GroupList groupList;
-        //                 auto& groupFields = groupList.groupFields;
-        //                 groupFields.push_back(GroupField::parseField(names[i1], index));
-        //                 groupFields.push_back(GroupField::parseField(names[i2], index));
-        //                 groupFields.push_back(GroupField::parseField(names[i3], index));
-        //                 groupFields.push_back(
-        //                     GroupField::parseExtendedField(yearsOnly[i4], index));
-        //                 groupList.sortGroupFields();
-        //
-        //                 GroupAggregationMap map;
-        //                 FOR_EACH_ACCOUNT_ID(id) {
-        //                     TRY_GET_CONST_DATA(id, data);
-        //                     groupList.updateMap(data, map);
-        //                 }
-        //                 std::string cacheKey = groupList.getCacheKey4D();
-        //                 std::cout << "  got " << map.size() << " items, cacheKey 4D = " <<
-        //                 cacheKey
-        //                           << std::endl;
-        //
-        //                 index.cachedGroup4D[cacheKey] = map;
-        //             }
-        //         }
-        //     }
-        // }
-        // MY_LOG_WITH_MEMORY("Finished 4D");
-
-        // std::cout << "Finished, mem = " << getUsedMemoryInMb() << " Mb " << std::endl;
+        // shapes of the profile that are not in the list above (e.g. one key with two filters)
+        std::vector<bool> added(_groupProfile.size(), false);
+        for (const auto& groupList : *groupListAll) {
+            added[groupList.getFieldsMask()] = true;
+        }
+        for (GroupFieldMask mask = 1; mask < _groupProfile.size(); ++mask) {
+            if (_groupProfile[mask] == 0 || added[mask] ||
+                __builtin_popcount(mask) > NUM_SUPPORTED_BREAKDOWNS) {
+                continue;
+            }
+            GroupList groupList;
+            for (const auto& name : splitString(getGroupFieldNames(mask), ',')) {
+                groupList.groupFields.push_back(GroupField::parseExtendedField(name, index));
+            }
+            groupListAll->push_back(std::move(groupList));
+        }
+
+        // the most requested go first, the rest keep the order above
+        std::stable_sort(groupListAll->begin(), groupListAll->end(),
+                         [&](const GroupList& a, const GroupList& b) {
+                             return _groupProfile[a.getFieldsMask()] >
+                                    _groupProfile[b.getFieldsMask()];
+                         });
+    }
+
+    // see GroupShapeStats::dump for the format
+    void loadGroupProfile(const std::string& fileName) {
+        _groupProfile.fill(0);
+        if (!fileExists(fileName)) {
+            MY_LOG_WITH_MEMORY("No group profile " << fileName << ", using default cubes");
+            return;
+        }
+        std::ifstream input(fileName);
+        std::string line;
+        int32_t numShapes = 0;
+        while (std::getline(input, line)) {
+            // other lines (e.g. of a captured log) are skipped
+            std::istringstream lineInput(line);
+            int64_t count;
+            std::string names;
+            if (!(lineInput >> count >> names)) {
+                continue;
+            }
+            auto mask = parseGroupFieldMask(names);
+            if (mask) {
+                _groupProfile[mask] += count;
+                ++numShapes;
+            }
+        }
+        MY_LOG_WITH_MEMORY("Loaded " << numShapes << " group shapes from " << fileName);
     }
 
-    void precomputeGroupResults(const std::vector<GroupList>& groupListAll) {
-        MY_LOG_WITH_MEMORY("Precomputing group results with " << groupListAll.size()
+    void precomputeGroupResults(std::vector<GroupList>* groupListAll) {
+        MY_LOG_WITH_MEMORY("Precomputing group results with " << groupListAll->size()
                                                               << " group lists");
 
-        int currentDimension = 1;
-        for (const auto& groupList : groupListAll) {
+        constexpr size_t memoryBudget = static_cast<size_t>(GROUP_CUBES_MEMORY_BUDGET_MB) << 20;
+        std::vector<bool> listed(index.cachedGroups.size());
+        for (const auto& groupList : *groupListAll) {
+            listed[groupList.getFieldsMask()] = true;
+        }
+        // cubes behind sorted views are still needed (and small anyway)
+        auto canRollUp = [&](const GroupList& groupList) {
+            auto rollupMask = getRollupFieldMask(groupList.getFieldsMask());
+            return ROLLUP_CITY_COUNTRY_CUBES && rollupMask &&
+                   listed[groupList.getFieldsMask() | rollupMask] &&
+                   !hasSortedGroupViews(groupList);
+        };
+        // the cubes with both city and country go first, the ones rolled up from them are only
+        // built if their wider cube didn't fit into the budget
+        std::stable_partition(groupListAll->begin(), groupListAll->end(),
+                              [&](const GroupList& groupList) { return !canRollUp(groupList); });
+
+        size_t memoryUsage = 0;
+        std::vector<GroupList> materialized;
+        for (auto& groupList : *groupListAll) {
+            auto mask = groupList.getFieldsMask();
+            auto rollupMask = getRollupFieldMask(mask);
+            if (canRollUp(groupList) && index.cachedGroups[mask | rollupMask]) {
+                MY_LOG(INFO_LEVEL, "  skipping " << groupList.getFieldNames() << ", rolled up from "
+                                                 << getGroupFieldNames(mask | rollupMask));
+                continue;
+            }
             groupList.createCachedGroup(index);
 
             GroupAggregationMap* map = groupList.getCachedGroupResult(index);
             constexpr int ADD_ACCOUNT = 1;
+            // the budget is checked while the cube is filled, so a cube that doesn't fit
+            // is dropped early instead of being built over all accounts first
+            constexpr int32_t BUDGET_CHECK_ACCOUNTS = 1 << 12;
 
+            bool outOfBudget = false;
             FOR_EACH_ACCOUNT_ID(id) {
+                if (id % BUDGET_CHECK_ACCOUNTS == 0 &&
+                    memoryUsage + map->getMemoryUsage() > memoryBudget) {
+                    outOfBudget = true;
+                    break;
+                }
                 TRY_GET_CONST_DATA(id, data);
                 groupList.updateMap(data, *map, ADD_ACCOUNT);
             }
 
-            std::string cacheKey = groupList.getCacheKeyGenericD();
-            MY_LOG(INFO_LEVEL, "  got " << map->size() << " items, cacheKey " << cacheKey);
-
-            if (groupList.groupFieldsSize() != currentDimension) {
-                MY_LOG_WITH_MEMORY("Finished " << currentDimension << "D");
-                currentDimension = groupList.groupFieldsSize();
+            auto cubeMemory = map->getMemoryUsage();
+            if (outOfBudget || memoryUsage + cubeMemory > memoryBudget) {
+                MY_LOG(INFO_LEVEL, "  skipping " << groupList.getFieldNames()
+                                                 << ", out of memory budget");
+                index.cachedGroups[mask].reset();
+                continue;
             }
+            MY_LOG(INFO_LEVEL,
+                   "  got " << map->size() << " items, fields " << groupList.getFieldNames());
+            memoryUsage += cubeMemory;
+            materialized.push_back(std::move(groupList));
         }
+        *groupListAll = std::move(materialized);
+
+        MY_LOG_WITH_MEMORY("Finished Group Results, " << groupListAll->size() << " cubes take "
+                                                      << (memoryUsage >> 20) << " Mb");
+    }
 
-        MY_LOG_WITH_MEMORY("Finished Group Results");
+    void buildInterestCooccurrence() {
+        auto& cooccurrence = index.interestCooccurrence;
+        cooccurrence.init(index.countryIdMap.size());
+        constexpr int ADD_ACCOUNT = 1;
+        FOR_EACH_ACCOUNT_ID(id) {
+            TRY_GET_CONST_DATA(id, data);
+            cooccurrence.update(data, ADD_ACCOUNT);
+        }
+        MY_LOG_WITH_MEMORY("Interest co-occurrence takes "
+                           << (cooccurrence.getMemoryUsage() >> 20) << " Mb");
     }
 
     void updateCachedGroupResult(const AccountData& data, int delta) {
-        for (auto& groupList : _groupListAll) {
+        index.interestCooccurrence.update(data, delta);
+        for (int i = 0; i < _groupListAll.size(); ++i) {
+            const auto& groupList = _groupListAll[i];
             GroupAggregationMap* map = groupList.getCachedGroupResult(index);
-            groupList.updateMap(data, *map, delta);
+            const auto& views = _groupListViews[i];
+            if (views.empty()) {
+                groupList.updateMap(data, *map, delta);
+                continue;
+            }
+            groupList.forEachKey(data, [&](GroupKey key) {
+                auto newCount = map->add(key, delta);
+                for (auto view : views) {
+                    view->update(key, newCount - delta, newCount, index);
+                }
+            });
+        }
+    }
+
+    bool hasSortedGroupViews(const GroupList& groupList) const {
+        if (groupList.groupFieldsSize() > SORTED_GROUP_VIEW_MAX_KEYS) {
+            return false;
+        }
+        for (const auto& field : groupList.groupFields) {
+            if (field->type == GroupFieldType::FAKE || field->type == GroupFieldType::PREMIUM) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // views for every order of keys of cached maps without extended fields (only used in filters)
+    void createSortedGroupViews() {
+        _sortedGroupViews.clear();
+        _groupListViews.clear();
+        _groupListViews.resize(_groupListAll.size());
+        for (int i = 0; i < _groupListAll.size(); ++i) {
+            const auto& groupList = _groupListAll[i];
+            if (!hasSortedGroupViews(groupList)) {
+                continue;
+            }
+            std::vector<GroupFieldMask> masks;
+            std::vector<GroupFieldType> order;
+            for (const auto& field : groupList.groupFields) {
+                masks.push_back(field->mask);
+                order.push_back(field->type);
+            }
+
+            const GroupAggregationMap* map = groupList.getCachedGroupResult(index);
+            // fields are sorted, so it goes through all permutations
+            std::vector<int32_t> permutation(masks.size());
+            std::iota(permutation.begin(), permutation.end(), 0);
+            do {
+                int32_t viewKey = 0;
+                std::vector<GroupFieldType> viewOrder;
+                for (auto j : permutation) {
+                    viewKey = appendGroupFieldOrder(viewKey, masks[j]);
+                    viewOrder.push_back(order[j]);
+                }
+                auto it = _sortedGroupViews.emplace(std::piecewise_construct,
+                                                    std::forward_as_tuple(viewKey),
+                                                    std::forward_as_tuple(map, viewOrder));
+                _groupListViews[i].push_back(&it.first->second);
+            } while (std::next_permutation(permutation.begin(), permutation.end()));
+        }
+    }
+
+    void buildSortedGroupViews() {
+        MY_LOG_WITH_MEMORY("Building " << _sortedGroupViews.size() << " sorted group views");
+        for (auto& [viewKey, view] : _sortedGroupViews) {
+            view.build(index);
+        }
+    }
+
+    // keys - fields of keys param of group query in the same order, see appendGroupFieldOrder
+    // the view may be invalid, see SortedGroupView::forEachInOrder
+    const SortedGroupView* getSortedGroupView(int32_t keys) const {
+        return stl::mapGetPtr(_sortedGroupViews, keys);
+    }
+
+    // Premium lists are small and selective (premium_now=1 often drives the plan),
+    // so they are kept up to date on every write instead of waiting for the rebuild.
+    // hadPremium / hadPremiumNow describe the account before the write.
+    // usersAll is only rebuilt: complement lookups subtract other rebuild-only lists from it.
+    void updatePremiumIndexes(const AccountData& data, bool hadPremium, bool hadPremiumNow) {
+        bool hasPremium = data.premiumStart > 0;
+        if (hasPremium != hadPremium) {
+            if (hasPremium) {
+                insertAccountId(index.usersWithPremium, data.id);
+            } else {
+                eraseAccountId(index.usersWithPremium, data.id);
+            }
+        }
+        if (data.hasPremiumNow != hadPremiumNow) {
+            if (data.hasPremiumNow) {
+                insertAccountId(index.usersWithPremiumNow, data.id);
+            } else {
+                eraseAccountId(index.usersWithPremiumNow, data.id);
+            }
+        }
+    }
+
+    // used to sort group results without comparing strings
+    void buildValueRanks() {
+        MY_LOG_WITH_MEMORY("Building ranks of interests, countries and cities");
+        index.interestIdMap.buildRanks();
+        index.countryIdMap.buildRanks();
+        index.cityIdMap.buildRanks();
+    }
+
+    // should be called after single value indexes are built
+    void buildValueBitmaps() {
+        MY_LOG_WITH_MEMORY("Building bitmaps of sex, status and country");
+        // lists are sorted in reversed order
+        index.bitmapMaxAccountId = index.usersAll.empty() ? 0 : index.usersAll[0];
+        auto numWords = AccountBitmap::getNumWords(index.bitmapMaxAccountId);
+        index.bitmapsAtSex.assign(SEX_CNT, AccountBitmap(numWords));
+        index.bitmapsAtStatus.assign(STATUS_CNT, AccountBitmap(numWords));
+        index.bitmapsAtCountryId.assign(index.countryIdMap.size(), AccountBitmap(numWords));
+        FOR_EACH_ACCOUNT_ID(id) {
+            TRY_GET_CONST_DATA(id, data);
+            index.bitmapsAtSex[static_cast<int32_t>(data.sexEnum)].set(id);
+            index.bitmapsAtStatus[static_cast<int32_t>(data.status)].set(id);
+            index.bitmapsAtCountryId[data.countryId].set(id);
         }
     }
 
@@ -273,11 +490,30 @@ class IndexLoader {
             index.usersAtCity[data.city].push_back(id);
             index.usersAtCountry[data.country].push_back(id);
             index.usersAtSex[data.sex].push_back(id);
-            index.usersAtEmailDomain[data.emailDomain].push_back(id);
+            index.usersAtFNameId[data.fnameId].push_back(id);
+            index.usersAtPhoneCodeId[data.phoneCodeId].push_back(id);
+            index.usersAtEmailDomainId[data.emailDomainId].push_back(id);
             index.usersAtStatus[static_cast<int8_t>(data.status)].push_back(id);
             index.usersAtJoinedYear[data.joinedYear].push_back(id);
             index.usersAtBirthYear[data.birthYear].push_back(id);
 
+            index.usersAll.push_back(id);
+            if (!data.fname.empty()) {
+                index.usersWithFName.push_back(id);
+            }
+            if (!data.sname.empty()) {
+                index.usersWithSName.push_back(id);
+            }
+            if (!data.phone.empty()) {
+                index.usersWithPhone.push_back(id);
+            }
+            if (data.premiumStart > 0) {
+                index.usersWithPremium.push_back(id);
+            }
+            if (data.hasPremiumNow) {
+                index.usersWithPremiumNow.push_back(id);
+            }
+
             for (const auto& interestId : data.interests) {
                 index.usersAtInterestId[interestId].push_back(id);
             }
@@ -336,7 +572,7 @@ class IndexLoader {
                 minTs = std::min(minTs, edge.ts);
                 maxTs = std::max(maxTs, edge.ts);
 
-                // totalDuplicatedLikes += (edge.nTs - 1);
+                totalDuplicatedLikes += (edge.count - 1);
             }
 
             minId = minId == -1 ? id : std::min(minId, data.id);
@@ -396,12 +632,15 @@ class IndexLoader {
 
     void loadAccountData(const json& j, AccountData& data) {
         loadStringData(j, "email", &data.email);
-        data.emailDomain = getEmailDomain(data.email);
+        data.emailDomainId = index.emailDomainIdMap.getOrCreateId(getEmailDomain(data.email));
 
         loadStringData(j, "fname", &data.fname);
         loadStringData(j, "sname", &data.sname);
         loadStringData(j, "phone", &data.phone);
 
+        data.fnameId = index.fnameIdMap.getOrCreateId(data.fname);
+        data.phoneCodeId = index.phoneCodeIdMap.getOrCreateId(getPhoneCode(data.phone));
+
         loadStringData(j, "sex", &data.sex);
         data.sexEnum = convertStringToSex(data.sex);
 
@@ -441,10 +680,9 @@ class IndexLoader {
                     //     continue;
                     // }
 
-                    auto& edge = data.likes.emplace_back();
-                    edge.accountId = accountId;
-                    edge.ts = like["ts"].get<int>();
+                    data.likes.emplace_back(accountId, like["ts"].get<int>());
                 }
+                aggregateLikeEdges(data.likes);
             }
         }
 
@@ -491,9 +729,7 @@ class IndexLoader {
                     continue;
                 }
                 MY_ASSERT(isValidId(accountsArray[edge.accountId].id));
-                auto& backwardEdge = accountsArray[edge.accountId].backwardLikes.emplace_back();
-                backwardEdge.accountId = id;
-                backwardEdge.ts = edge.ts;
+                accountsArray[edge.accountId].backwardLikes.emplace_back(id, edge.ts, edge.count);
             }
         }
     }
@@ -501,4 +737,11 @@ class IndexLoader {
    private:
     IndexStorage& index;
     std::vector<GroupList> _groupListAll;
+
+    // number of group queries by combined fields, see loadGroupProfile
+    std::array<int64_t, 1 << NUM_GROUP_FIELD_BITS> _groupProfile{};
+    // key is the order of group keys of the query, see appendGroupFieldOrder
+    std::unordered_map<int32_t, SortedGroupView> _sortedGroupViews;
+    // views of the cached map of _groupListAll[i]
+    std::vector<std::vector<SortedGroupView*>> _groupListViews;
 };
@@ -12,6 +12,16 @@ struct IdIterator {
 
     virtual int32_t size() = 0;
     virtual AccountId getId() = 0;
+
+    // fills ids with up to capacity next values, returns number of filled ids (0 at the end)
+    virtual int32_t fillBlock(AccountId* ids, int32_t capacity) {
+        int32_t filled = 0;
+        while (filled < capacity && valid()) {
+            ids[filled++] = getId();
+            next();
+        }
+        return filled;
+    }
 };
 
 struct IdListIterator : public IdIterator {
@@ -37,6 +47,16 @@ struct IdListIterator : public IdIterator {
     }
 
     AccountId getId() override { return (*list)[current]; }
+
+    int32_t fillBlock(AccountId* ids, int32_t capacity) override {
+        int32_t filled = std::min(capacity, end - current);
+        if (filled <= 0) {
+            return 0;
+        }
+        std::copy_n(list->data() + current, filled, ids);
+        current += filled;
+        return filled;
+    }
 };
 
 struct LikeEdgeIterator : public IdIterator {
@@ -54,13 +74,8 @@ struct LikeEdgeIterator : public IdIterator {
             // if iterator is empty do nothing
             return;
         }
-        // std::cout << "::next(), current = " << current;
-        // skip repeating ids
-        auto lastId = getId();
+        // repeated likes are aggregated, so ids are unique
         ++current;
-        while (valid() && (getId() == lastId)) {
-            ++current;
-        }
     }
 
     bool valid() override { return current < end; }
@@ -131,6 +146,160 @@ struct IntersectionIdIterator : public IdIterator {
     }
 };
 
+struct MultiIntersectionIdIterator : public IdIterator {
+    // assumption: all iterators should go in reverse order
+    std::vector<std::unique_ptr<IdIterator>> iterators;
+    AccountId value{INVALID_ID};
+    bool exhausted{false};
+
+    explicit MultiIntersectionIdIterator(std::vector<std::unique_ptr<IdIterator>> iterators_)
+        : iterators(std::move(iterators_)) {
+        MY_ASSERT(!iterators.empty());
+        // smallest first: it drives the iteration, so cost depends on its size only
+        std::sort(iterators.begin(), iterators.end(),
+                  [](const auto& a, const auto& b) { return a->size() < b->size(); });
+        if (iterators[0]->size() == 0) {
+            exhausted = true;
+        }
+    }
+
+    bool valid() override {
+        iterateUntilMatch();
+        return !exhausted;
+    }
+
+    void next() override {
+        for (auto& it : iterators) {
+            while (it->valid() && (it->getId() == value)) {
+                it->next();
+            }
+        }
+        iterateUntilMatch();
+    }
+
+    int32_t size() override { return iterators[0]->size(); }
+
+    AccountId getId() override { return value; }
+
+    // or until one of them becomes invalid
+    void iterateUntilMatch() {
+        auto& first = iterators[0];
+        while (!exhausted) {
+            if (!first->valid()) {
+                exhausted = true;
+                return;
+            }
+            auto candidate = first->getId();
+            bool matched = true;
+            for (int i = 1; i < iterators.size(); ++i) {
+                auto& it = iterators[i];
+                while (it->valid() && it->getId() > candidate) {
+                    it->next();
+                }
+                if (!it->valid()) {
+                    exhausted = true;
+                    return;
+                }
+                if (it->getId() < candidate) {
+                    // candidate is missing in one of the lists, skip it in the first one
+                    auto bound = it->getId();
+                    while (first->valid() && first->getId() > bound) {
+                        first->next();
+                    }
+                    matched = false;
+                    break;
+                }
+            }
+            if (matched) {
+                value = candidate;
+                return;
+            }
+        }
+    }
+};
+
+struct UnionIdIterator : public IdIterator {
+    // assumption: all iterators should go in reverse order
+    // the number of iterators is small (e.g. values of fname_any), so looking up
+    // the biggest current id is a linear scan
+    std::vector<std::unique_ptr<IdIterator>> iterators;
+    AccountId value{INVALID_ID};
+
+    explicit UnionIdIterator(std::vector<std::unique_ptr<IdIterator>> iterators_)
+        : iterators(std::move(iterators_)) {
+        findBiggest();
+    }
+
+    bool valid() override { return value != INVALID_ID; }
+
+    void next() override {
+        for (auto& it : iterators) {
+            if (it->valid() && it->getId() == value) {
+                it->next();
+            }
+        }
+        findBiggest();
+    }
+
+    int32_t size() override {
+        int32_t result = 0;
+        for (auto& it : iterators) {
+            result += it->size();
+        }
+        return result;
+    }
+
+    AccountId getId() override { return value; }
+
+    void findBiggest() {
+        value = INVALID_ID;
+        for (auto& it : iterators) {
+            if (it->valid() && (value == INVALID_ID || it->getId() > value)) {
+                value = it->getId();
+            }
+        }
+    }
+};
+
+struct DifferenceIdIterator : public IdIterator {
+    // assumption: a and b should both go in reverse order
+    // iterates over ids from a that are not present in b
+    std::unique_ptr<IdIterator> a;
+    std::unique_ptr<IdIterator> b;
+
+    DifferenceIdIterator(std::unique_ptr<IdIterator> a_, std::unique_ptr<IdIterator> b_)
+        : a(std::move(a_)), b(std::move(b_)) {}
+
+    bool valid() override {
+        skipExcluded();
+        return a->valid();
+    }
+
+    void next() override {
+        a->next();
+        skipExcluded();
+    }
+
+    // exact when b is a subset of a (e.g. all accounts minus some index)
+    int32_t size() override { return std::max(0, a->size() - b->size()); }
+
+    AccountId getId() override { return a->getId(); }
+
+    void skipExcluded() {
+        while (a->valid()) {
+            auto va = a->getId();
+            while (b->valid() && b->getId() > va) {
+                b->next();
+            }
+            if (b->valid() && b->getId() == va) {
+                a->next();
+                continue;
+            }
+            return;
+        }
+    }
+};
+
 #define CREATE_EMPTY_ITERATOR() std::make_unique<IdListIterator>()
 #define RETURN_ITERATOR_FROM_MAP(map, value)           \
     MY_ASSERT(index);                                  \
@@ -140,3 +309,24 @@ struct IntersectionIdIterator : public IdIterator {
     } else {                                           \
         return CREATE_EMPTY_ITERATOR();                \
     }
+
+// value ids created after the last rebuild are not indexed yet
+std::unique_ptr<IdIterator> createIteratorFromIntIndex(const UsersAtIntIndex& usersAtValue,
+                                                       int32_t valueId) {
+    if (valueId < 0 || valueId >= usersAtValue.size()) {
+        return CREATE_EMPTY_ITERATOR();
+    }
+    return std::make_unique<IdListIterator>(usersAtValue[valueId]);
+}
+
+// iterates over all existing accounts except the ones from excluded list
+std::unique_ptr<IdIterator> createComplementIterator(const IndexStorage* index,
+                                                     const AccountIdList* excluded) {
+    MY_ASSERT(index);
+    auto all = std::make_unique<IdListIterator>(index->usersAll);
+    if (!excluded) {
+        return all;
+    }
+    return std::make_unique<DifferenceIdIterator>(std::move(all),
+                                                  std::make_unique<IdListIterator>(*excluded));
+}
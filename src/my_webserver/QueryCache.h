@@ -0,0 +1,92 @@
+#pragma once
+
+#include <array>
+#include <mutex>
+
+#include "Base.h"
+#include "Types.h"
+
+// Serialized responses of GET queries.
+// Every write bumps the epoch (see Server::writeEpoch), which invalidates all cached responses.
+class QueryCache {
+   public:
+    // normalized set of params: sorted keys, query_id is skipped
+    // Decoded keys and values may contain any characters, so they are prefixed by their length.
+    static std::string getKey(const std::string& api, const RequestParams& params) {
+        std::vector<std::pair<std::string, std::string>> sorted;
+        sorted.reserve(params.size());
+        for (const auto& [key, value] : params) {
+            if (key == "query_id") {
+                continue;
+            }
+            sorted.emplace_back(key, value);
+        }
+        std::sort(sorted.begin(), sorted.end());
+
+        std::string result = api;
+        result += '?';
+        for (const auto& [key, value] : sorted) {
+            result += std::to_string(key.size());
+            result += ':';
+            result += key;
+            result += '=';
+            result += std::to_string(value.size());
+            result += ':';
+            result += value;
+            result += '&';
+        }
+        return result;
+    }
+
+    // returns true if response computed at the same epoch is found
+    bool get(const std::string& key, int64_t epoch, std::string* body) {
+        if (!ENABLE_QUERY_CACHE) {
+            return false;
+        }
+        auto& shard = getShard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.epoch != epoch) {
+            return false;
+        }
+        auto ptr = stl::mapGetPtr(shard.responses, key);
+        if (!ptr) {
+            return false;
+        }
+        *body = *ptr;
+        return true;
+    }
+
+    // epoch should be taken before the response started computing
+    void put(const std::string& key, int64_t epoch, const std::string& body) {
+        if (!ENABLE_QUERY_CACHE) {
+            return;
+        }
+        auto& shard = getShard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.epoch > epoch) {
+            // there were writes while computing the response
+            return;
+        }
+        if (shard.epoch < epoch || shard.responses.size() >= MAX_SHARD_SIZE) {
+            shard.responses.clear();
+            shard.epoch = epoch;
+        }
+        shard.responses[key] = body;
+    }
+
+   private:
+    static constexpr int NUM_SHARDS = 16;
+    static constexpr size_t MAX_SHARD_SIZE = QUERY_CACHE_MAX_SIZE / NUM_SHARDS;
+
+    struct Shard {
+        std::mutex mutex;
+        int64_t epoch{0};
+        std::unordered_map<std::string, std::string> responses;
+    };
+
+    Shard& getShard(const std::string& key) {
+        return _shards[std::hash<std::string>()(key) % NUM_SHARDS];
+    }
+
+    std::array<Shard, NUM_SHARDS> _shards;
+};
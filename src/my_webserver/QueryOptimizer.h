@@ -1,9 +1,13 @@
 #pragma once
 
 #include "Filter.h"
+#include "QueryPlan.h"
+#include "WorkerPool.h"
 
 // rewrites the query into single lookup (by smallest field) + the rest of the filters
-std::unique_ptr<OptimizedFilter> rewriteFilters(std::vector<std::unique_ptr<Filter>>& filters) {
+// plan is optional and is only filled for explain API
+std::unique_ptr<OptimizedFilter> rewriteFilters(std::vector<std::unique_ptr<Filter>>& filters,
+                                                QueryPlan* plan = nullptr) {
     MY_LOG(INFO_LEVEL, "rewriting query with " << filters.size() << " filters ");
     int minOutputSize = 0;
     int bestIndex = -1;
@@ -12,6 +16,9 @@ std::unique_ptr<OptimizedFilter> rewriteFilters(std::vector<std::unique_ptr<Filt
             MY_LOG(INFO_LEVEL, "  estimating size " << filters[i]->name);
             int outputSize = filters[i]->estimateOutputSize();
             MY_LOG(INFO_LEVEL, "    filter " << filters[i]->name << ", size = " << outputSize);
+            if (plan) {
+                plan->lookupEstimates.emplace_back(filters[i]->name, outputSize);
+            }
             if (bestIndex == -1 || outputSize < minOutputSize) {
                 minOutputSize = outputSize;
                 bestIndex = i;
@@ -30,18 +37,87 @@ std::unique_ptr<OptimizedFilter> rewriteFilters(std::vector<std::unique_ptr<Filt
                 result->filters.push_back(std::move(filters[i]));
             }
         }
+        if (plan) {
+            plan->lookupFilter = result->lookupFilter->name;
+            plan->estimatedRows = minOutputSize;
+            for (const auto& filter : result->filters) {
+                plan->residualFilters.push_back(filter->name);
+            }
+        }
         return result;
     }
     return nullptr;
 }
 
+constexpr int32_t LOOKUP_BLOCK_SIZE = 256;
+
+// Evaluates lookup candidates block by block: prefetches account rows of the whole block,
+// drops empty accounts and then applies residual filters one filter at a time.
+// consume(id) is called for every match in order, iteration stops once it returns false.
+// Blocks start from firstBlockSize and grow up to LOOKUP_BLOCK_SIZE, so that queries with small
+// limit don't evaluate too many extra candidates.
+// Returns number of examined candidates.
+template <class Consumer>
+int32_t runLookupInBlocks(const IndexStorage& index, OptimizedFilter* optimizedFilter,
+                          bool checkLookup, int32_t firstBlockSize, Consumer&& consume) {
+    AccountId block[LOOKUP_BLOCK_SIZE];
+    int32_t blockSize = std::clamp(firstBlockSize, 1, LOOKUP_BLOCK_SIZE);
+    int32_t examined = 0;
+
+    const auto& accountsArray = index.accountsArray;
+    auto idIterator = optimizedFilter->lookupFilter->findRemainingItems();
+    while (true) {
+        int32_t size = idIterator->fillBlock(block, blockSize);
+        if (size == 0) {
+            break;
+        }
+        examined += size;
+
+        for (int32_t i = 0; i < size; ++i) {
+            __builtin_prefetch(&accountsArray[block[i]]);
+        }
+        int32_t selected = 0;
+        for (int32_t i = 0; i < size; ++i) {
+            if (isValidId(accountsArray[block[i]].id)) {
+                block[selected++] = block[i];
+            }
+        }
+        if (checkLookup) {
+            // skip the ones that doesn't match lookup
+            selected = optimizedFilter->lookupFilter->filterBlock(block, selected);
+        }
+        selected = optimizedFilter->filterBlock(block, selected);
+
+        for (int32_t i = 0; i < selected; ++i) {
+            if (!consume(block[i])) {
+                return examined;
+            }
+        }
+        blockSize = std::min(2 * blockSize, LOOKUP_BLOCK_SIZE);
+    }
+    return examined;
+}
+
+// scanning that many words of a bitmap costs about the same as aggregating one account
+constexpr int32_t BITMAP_WORDS_PER_ROW = 32;
+// groups are counted one by one, so only keys with few combinations of values are supported
+constexpr int32_t BITMAP_COUNT_MAX_GROUPS = 256;
+
 struct GroupOptimizer {
     IndexStorage& index;
     GroupAggregationMap* map;
+    // either map or one of the cached maps (not copied), the caller holds the shared lock of
+    // cached groups while it is read, see Server::cachedGroupsMutex
+    const GroupAggregationMap* result;
+    // used to run full scan in parallel, optional
+    WorkerPool* pool;
+    // only filled for explain API
+    QueryPlan* plan;
     static constexpr int ADD_ACCOUNT = 1;
 
-    explicit GroupOptimizer(IndexStorage& index_, GroupAggregationMap* map_)
-        : index(index_), map(map_) {}
+    explicit GroupOptimizer(IndexStorage& index_, GroupAggregationMap* map_,
+                            WorkerPool* pool_ = nullptr, QueryPlan* plan_ = nullptr)
+        : index(index_), map(map_), result(map_), pool(pool_), plan(plan_) {}
 
     bool tryLookupOptimization(GroupList* groupList) {
         // only works when there is filter
@@ -49,19 +125,23 @@ struct GroupOptimizer {
             return false;
         }
 
-        auto optimizedFilter = rewriteFilters(groupList->filters);
+        auto optimizedFilter = rewriteFilters(groupList->filters, plan);
         if (!optimizedFilter) {
             return false;
         }
-        auto idIterator = optimizedFilter->lookupFilter->findRemainingItems();
-        for (; idIterator->valid(); idIterator->next()) {
-            auto id = idIterator->getId();
-            const auto& data = index.accountsArray[id];
-            if (data.id > 0) {
-                if (optimizedFilter->matches(id, data)) {
-                    groupList->updateMap(data, *map, ADD_ACCOUNT);
-                }
-            }
+        groupList->initMap(*map);
+        int32_t matched = 0;
+        auto examined = runLookupInBlocks(
+            index, optimizedFilter.get(), /* checkLookup */ false, LOOKUP_BLOCK_SIZE,
+            [&](AccountId id) {
+                ++matched;
+                groupList->updateMap(index.accountsArray[id], *map, ADD_ACCOUNT);
+                return true;
+            });
+        if (plan) {
+            plan->strategy = "lookup";
+            plan->rowsExamined = examined;
+            plan->rowsMatched = matched;
         }
         return true;
     }
@@ -69,29 +149,81 @@ struct GroupOptimizer {
     bool tryNoFilterCachedOptimization(GroupList* groupList) {
         if (groupList->filters.empty()) {
             // No fiters
-            if (groupList->groupFields.size() <= NUM_SUPPORTED_BREAKDOWNS) {
-                auto ptr = getCachedGroupResult(groupList);
-                *map = *ptr;
+            auto ptr = getCachedGroupResult(groupList);
+            if (ptr) {
+                // cubes out of the memory budget are dropped
+                result = ptr;
+                if (plan) {
+                    plan->strategy = "cached_no_filter";
+                    plan->cacheKey = groupList->getFieldNames();
+                    plan->estimatedRows = ptr->size();
+                    plan->rowsExamined = ptr->size();
+                    plan->rowsMatched = ptr->size();
+                }
                 return true;
             }
         }
         return false;
     }
 
-    GroupAggregationMap* getCachedGroupResult(const std::string& cacheKey, int size) {
-        return index.getCachedGroupResult(cacheKey, size);
-    }
-
     GroupAggregationMap* getCachedGroupResult(GroupList* groupList) {
         return groupList->getCachedGroupResult(index);
     }
 
-    bool isCachedBreakdown(const std::string& name) {
-        if (name == "sex" || name == "status" || name == "interests" || name == "country" ||
-            name == "city" || name == "joined" || name == "birth") {
-            return true;
+    // GROUP(interests) + FILTER(interests = x) + optional FILTER(sex, status, country)
+    // counts all interests of accounts having x, that is a row of co-occurrence matrix
+    bool tryInterestCooccurrenceOptimization(GroupList* groupList) {
+        if (groupList->groupFields.size() != 1 ||
+            groupList->groupFields[0]->type != GroupFieldType::INTERESTS) {
+            return false;
         }
-        return false;
+        if (groupList->findMatchingFilter("interests") == INVALID_ID) {
+            return false;
+        }
+        int32_t interestId = INVALID_ID;
+        int32_t sexId = INVALID_ID;
+        int32_t statusId = INVALID_ID;
+        int32_t countryId = INVALID_ID;
+        bool unknownValue = false;
+        for (const auto& filter : groupList->filters) {
+            const auto& name = filter->name;
+            int32_t* valueId;
+            if (name == "interests") {
+                valueId = &interestId;
+            } else if (name == "sex") {
+                valueId = &sexId;
+            } else if (name == "status") {
+                valueId = &statusId;
+            } else if (name == "country") {
+                valueId = &countryId;
+            } else {
+                return false;
+            }
+            *valueId = filter->getValueId();
+            // no account matches value that doesn't exist
+            unknownValue |= (*valueId == INVALID_ID);
+        }
+
+        std::array<int32_t, InterestCooccurrence::MAX_INTERESTS> row{};
+        if (!unknownValue && !index.interestCooccurrence.addRow(sexId, statusId, countryId,
+                                                                interestId, row.data())) {
+            return false;
+        }
+        groupList->initMap(*map);
+        for (int32_t i = 0; i < row.size(); ++i) {
+            if (row[i] > 0) {
+                map->insert(appendGroupValue(0, GroupValue{i, GroupFieldType::INTERESTS}), row[i]);
+            }
+        }
+        if (plan) {
+            plan->strategy = "interest_cooccurrence";
+            plan->rowsExamined = row.size();
+            plan->rowsMatched = map->size();
+            for (const auto& filter : groupList->filters) {
+                plan->residualFilters.push_back(filter->name);
+            }
+        }
+        return true;
     }
 
     // We use optimization that
@@ -104,52 +236,59 @@ struct GroupOptimizer {
         if (filters.size() > 2) {
             return false;
         }
-        for (const auto& filter : filters) {
-            const auto& name = filter->name;
-            if (!isCachedBreakdown(name)) {
+        GroupFieldMask combinedMask = groupList->getFieldsMask();
+        std::array<GroupFieldMask, 2> filterMasks;
+        for (int i = 0; i < filters.size(); ++i) {
+            filterMasks[i] = getGroupFieldMask(filters[i]->name);
+            if (!filterMasks[i]) {
+                // not a breakdown of any cached group
+                return false;
+            }
+            if (filters[i]->name == "interests" && (combinedMask & filterMasks[i])) {
+                // an account has many interests, filtering the breakdown by x would only leave
+                // the group of x itself instead of all interests of the matching accounts
                 return false;
             }
+            combinedMask |= filterMasks[i];
         }
 
-        std::string combinedKey;
-        int size;
-        groupList->getCombinedCacheKey(combinedKey, size);
-        auto ptr = getCachedGroupResult(combinedKey, size);
-        if (!ptr) {
+        if (__builtin_popcount(combinedMask) > NUM_SUPPORTED_BREAKDOWNS) {
+            // only certain amount of breakdowns is currently supported
             return false;
         }
+        auto ptr = index.getCachedGroupResult(combinedMask);
+        // the field the cube is summed up over, see getRollupFieldMask
+        GroupFieldMask rollupMask = 0;
+        if (!ptr) {
+            rollupMask = getRollupFieldMask(combinedMask);
+            if (!rollupMask) {
+                return false;
+            }
+            ptr = index.getCachedGroupResult(combinedMask | rollupMask);
+            if (!ptr) {
+                return false;
+            }
+        }
+        GroupFieldMask cubeMask = combinedMask | rollupMask;
 
-        for (const auto& filter : filters) {
-            const auto& name = filter->name;
+        for (int i = 0; i < filters.size(); ++i) {
             // try to find the filter among breakdowns
-            int matchingIndex = groupList->findMatchingGroupField(name);
-            if (matchingIndex == -1) {
+            if (!(groupList->getFieldsMask() & filterMasks[i])) {
+                const auto& name = filters[i]->name;
                 MY_LOG(INFO_LEVEL, "adding field " << name << " as a new breakdown");
                 // not found - add field as breakdown
                 groupList->groupFields.emplace_back(GroupField::parseExtendedField(name, index));
-            } else {
-                // found -- using existing breakdowns
-                // only need to re-compute the matchingIndex to point into right place
-                // se below
             }
         }
 
         // get to canonical form
         groupList->sortGroupFields();
 
-        // remember matcing indexes
+        // remember matcing indexes (in the cube)
         std::vector<int> matchingIndexes;
         matchingIndexes.reserve(filters.size());
-        for (const auto& filter : filters) {
-            const auto& name = filter->name;
-            int matchingIndex = groupList->findMatchingGroupField(name);
-            MY_ASSERT(matchingIndex != INVALID_ID);
-            matchingIndexes.push_back(matchingIndex);
-        }
-
-        if (groupList->groupFields.size() > NUM_SUPPORTED_BREAKDOWNS) {
-            // only certain amount of breakdowns is currently supported
-            return false;
+        for (int i = 0; i < filters.size(); ++i) {
+            matchingIndexes.push_back(getGroupFieldPosition(cubeMask, filterMasks[i]));
         }
 
         MY_LOG(INFO_LEVEL, "using cached group optimization with " << groupList->groupFields.size()
@@ -159,30 +298,181 @@ struct GroupOptimizer {
         MY_LOG(INFO_LEVEL, "extracted " << ptr->size() << " elements");
 
         // filter only matching values
-        for (const auto& [key, item] : *ptr) {
-            bool matches = true;
+        int32_t rollupPosition = rollupMask ? getGroupFieldPosition(cubeMask, rollupMask) : 0;
+        if (rollupMask) {
+            groupList->initMap(*map);
+        } else {
+            map->init(ptr->getTypes());
+        }
+        ptr->forEach([&](GroupKey key, int32_t count) {
             for (int i = 0; i < filters.size(); ++i) {
                 auto valueId = filters[i]->getValueId();
                 if (valueId == INVALID_ID) {
-                    matches = false;
-                    break;
+                    return;
                 }
 
-                if (item.groupValues[matchingIndexes[i]].valueId != valueId) {
-                    matches = false;
-                    break;
+                if (ptr->getValue(key, matchingIndexes[i]).valueId != valueId) {
+                    return;
                 }
             }
-            if (matches) {
-                (*map)[key] = item;
+            if (!rollupMask) {
+                map->insert(key, count);
+            } else if (count > 0) {
+                map->add(ptr->removeValue(key, rollupPosition), count);
+            }
+        });
+        if (plan) {
+            plan->strategy = rollupMask ? "cached_rollup" : "cached_breakdown";
+            plan->cacheKey = getGroupFieldNames(cubeMask);
+            plan->estimatedRows = ptr->size();
+            plan->rowsExamined = ptr->size();
+            plan->rowsMatched = map->size();
+            for (const auto& filter : filters) {
+                plan->residualFilters.push_back(filter->name);
             }
         }
         return true;
     }
 
+    const std::vector<AccountBitmap>* getValueBitmaps(GroupFieldType type) const {
+        switch (type) {
+            case GroupFieldType::SEX:
+                return &index.bitmapsAtSex;
+            case GroupFieldType::STATUS:
+                return &index.bitmapsAtStatus;
+            case GroupFieldType::COUNTRY:
+                return &index.bitmapsAtCountryId;
+            default:
+                return nullptr;
+        }
+    }
+
+    // When all keys are sex, status or country (few values each) groups are counted as
+    // popcount(matching & value1 & value2 ...) over bitmaps of account ids.
+    // Matching accounts are the intersection of bitmaps of filters, the ones without
+    // precomputed bitmap are converted from their lookups.
+    bool tryBitmapCountOptimization(GroupList* groupList) {
+        const auto& filters = groupList->filters;
+        if (filters.empty()) {
+            return false;
+        }
+        std::vector<const std::vector<AccountBitmap>*> keyBitmaps;
+        std::vector<GroupFieldType> keyTypes;
+        int32_t numGroups = 1;
+        for (const auto& field : groupList->groupFields) {
+            auto bitmaps = getValueBitmaps(field->type);
+            if (!bitmaps) {
+                return false;
+            }
+            keyBitmaps.push_back(bitmaps);
+            keyTypes.push_back(field->type);
+            numGroups *= bitmaps->size();
+        }
+        if (numGroups == 0 || numGroups > BITMAP_COUNT_MAX_GROUPS) {
+            return false;
+        }
+
+        // both costs are measured in aggregated accounts
+        auto numWords = AccountBitmap::getNumWords(index.bitmapMaxAccountId);
+        int64_t bitmapCost =
+            static_cast<int64_t>(numWords) * (filters.size() + numGroups) / BITMAP_WORDS_PER_ROW;
+        int64_t lookupCost = index.usersAll.size();
+        for (const auto& filter : filters) {
+            if (!filter->supportsLookup()) {
+                return false;
+            }
+            int64_t size = filter->estimateOutputSize();
+            lookupCost = std::min(lookupCost, size);
+            if (!filter->getBitmap()) {
+                bitmapCost += size;
+            }
+        }
+        if (bitmapCost >= lookupCost) {
+            return false;
+        }
+
+        AccountBitmap matching;
+        bool initialized = false;
+        std::array<AccountId, LOOKUP_BLOCK_SIZE> ids;
+        // sparse lookups go first, so that bitmaps are only intersected with them
+        for (const auto& filter : filters) {
+            if (filter->getBitmap()) {
+                continue;
+            }
+            AccountBitmap lookup(numWords);
+            // interests lookup only goes through one of the values, see tryOptimizedFilterQuery
+            bool checkLookup = (filter->name == "interests");
+            auto iterator = filter->findRemainingItems();
+            while (auto filled = iterator->fillBlock(ids.data(), ids.size())) {
+                if (checkLookup) {
+                    filled = filter->filterBlock(ids.data(), filled);
+                }
+                for (int32_t i = 0; i < filled; ++i) {
+                    lookup.set(ids[i]);
+                }
+            }
+            if (initialized) {
+                matching.intersect(lookup);
+            } else {
+                matching = std::move(lookup);
+                initialized = true;
+            }
+        }
+        for (const auto& filter : filters) {
+            auto bitmap = filter->getBitmap();
+            if (!bitmap) {
+                continue;
+            }
+            if (initialized) {
+                matching.intersect(*bitmap);
+            } else {
+                matching = *bitmap;
+                initialized = true;
+            }
+        }
+
+        groupList->initMap(*map);
+        std::vector<AccountBitmap> levels(keyBitmaps.size());
+        countBitmapGroups(0, 0, matching, keyBitmaps, keyTypes, levels);
+        if (plan) {
+            plan->strategy = "bitmap_count";
+            plan->estimatedRows = bitmapCost;
+            plan->rowsExamined = numWords * (filters.size() + numGroups);
+            plan->rowsMatched = map->size();
+            for (const auto& filter : filters) {
+                plan->residualFilters.push_back(filter->name);
+            }
+        }
+        return true;
+    }
+
+    // levels[i] keeps matching accounts with fixed values of first i + 1 keys
+    void countBitmapGroups(int32_t level, GroupKey key, const AccountBitmap& matching,
+                           const std::vector<const std::vector<AccountBitmap>*>& keyBitmaps,
+                           const std::vector<GroupFieldType>& keyTypes,
+                           std::vector<AccountBitmap>& levels) {
+        const auto& bitmaps = *keyBitmaps[level];
+        bool lastLevel = (level + 1 == keyBitmaps.size());
+        for (int32_t valueId = 0; valueId < bitmaps.size(); ++valueId) {
+            auto newKey = appendGroupValue(key, GroupValue{valueId, keyTypes[level]});
+            if (lastLevel) {
+                auto count = AccountBitmap::countIntersection(matching, bitmaps[valueId]);
+                if (count > 0) {
+                    map->insert(newKey, count);
+                }
+            } else if (levels[level].assignIntersection(matching, bitmaps[valueId]) > 0) {
+                countBitmapGroups(level + 1, newKey, levels[level], keyBitmaps, keyTypes, levels);
+            }
+        }
+    }
+
     // returns true if success
     // only modifies groupList if optimiztion was found
     bool tryOptimizedGroupQuery(GroupList* groupList) {
+        if (tryInterestCooccurrenceOptimization(groupList)) {
+            return true;
+        }
+
         if (tryFilterBreakdownIsCachedOptimization(groupList)) {
             return true;
         }
@@ -191,6 +481,10 @@ struct GroupOptimizer {
             return true;
         }
 
+        if (tryBitmapCountOptimization(groupList)) {
+            return true;
+        }
+
         if (tryLookupOptimization(groupList)) {
             return true;
         }
@@ -203,10 +497,57 @@ struct GroupOptimizer {
         }
 
         // otherwise fallback naive case
-        FOR_EACH_ACCOUNT_ID(id) {
-            TRY_GET_CONST_DATA(id, data);
-            if (groupList->matches(id, data)) {
-                groupList->updateMap(data, *map, ADD_ACCOUNT);
+        // every thread aggregates its partitions into its own map, merged at the end
+        int32_t numSlots = pool ? pool->numSlots() : 1;
+        std::vector<GroupAggregationMap> partialMaps(numSlots);
+        // only touched by the thread of the slot
+        std::vector<char> usedSlots(numSlots);
+        std::atomic<int32_t> examined{0};
+        std::atomic<int32_t> matched{0};
+        auto scanPartition = [&](int32_t partition, int32_t slot) {
+            auto& partialMap = partialMaps[slot];
+            if (!usedSlots[slot]) {
+                usedSlots[slot] = true;
+                groupList->initMap(partialMap);
+            }
+            int32_t partitionExamined = 0;
+            int32_t partitionMatched = 0;
+            FOR_EACH_ACCOUNT_ID_IN_PARTITION(id, partition) {
+                TRY_GET_CONST_DATA(id, data);
+                ++partitionExamined;
+                if (groupList->matches(id, data)) {
+                    ++partitionMatched;
+                    groupList->updateMap(data, partialMap, ADD_ACCOUNT);
+                }
+            }
+            examined += partitionExamined;
+            matched += partitionMatched;
+        };
+        if (pool) {
+            pool->parallelForSlots(NUM_SCAN_PARTITIONS, scanPartition);
+        } else {
+            for (int32_t partition = 0; partition < NUM_SCAN_PARTITIONS; ++partition) {
+                scanPartition(partition, 0);
+            }
+        }
+        if (usedSlots[0]) {
+            // slot 0 was used by some partition, its map is reused as the result
+            *map = std::move(partialMaps[0]);
+        } else {
+            groupList->initMap(*map);
+        }
+        for (int32_t slot = 1; slot < numSlots; ++slot) {
+            if (usedSlots[slot]) {
+                mergeGroupAggregationMap(*map, partialMaps[slot]);
+            }
+        }
+        if (plan) {
+            plan->strategy = "full_scan";
+            plan->estimatedRows = MAX_ACCOUNT_ID;
+            plan->rowsExamined = examined;
+            plan->rowsMatched = matched;
+            for (const auto& filter : groupList->filters) {
+                plan->residualFilters.push_back(filter->name);
             }
         }
     }
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "Base.h"
+#include "Timer.h"
+
+// Describes how filter/group query was executed, used by explain API.
+// Optimizers fill it only when non-null pointer is given.
+struct QueryPlan {
+    // one of: lookup, full_scan, cached_breakdown, cached_no_filter
+    std::string strategy;
+
+    std::string lookupFilter;
+    std::vector<std::string> residualFilters;
+    // estimated output size of every filter that supports lookup
+    std::vector<std::pair<std::string, int32_t>> lookupEstimates;
+
+    // key of precomputed group result, if used
+    std::string cacheKey;
+
+    int32_t estimatedRows{-1};
+    int32_t rowsExamined{0};
+    int32_t rowsMatched{0};
+
+    std::vector<std::pair<std::string, double>> stageTimes;
+
+    // measures time since previous stage
+    void finishStage(const std::string& name) {
+        stageTimes.emplace_back(name, _stageTimer.elapsedMicroseconds());
+        _stageTimer.start();
+    }
+
+    void start() { _stageTimer.start(); }
+
+    void toJson(json& j) const {
+        j["strategy"] = strategy;
+        if (!lookupFilter.empty()) {
+            j["lookup_filter"] = lookupFilter;
+        }
+        j["residual_filters"] = residualFilters;
+        for (const auto& [name, size] : lookupEstimates) {
+            j["lookup_estimates"].push_back({{"filter", name}, {"size", size}});
+        }
+        if (!cacheKey.empty()) {
+            j["cache_key"] = cacheKey;
+        }
+        j["estimated_rows"] = estimatedRows;
+        j["rows_examined"] = rowsExamined;
+        j["rows_matched"] = rowsMatched;
+        for (const auto& [name, us] : stageTimes) {
+            j["stages"].push_back({{"stage", name}, {"time_us", us}});
+        }
+    }
+
+   private:
+    Timer _stageTimer;
+};
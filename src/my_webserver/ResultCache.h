@@ -0,0 +1,150 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
+
+#include "Base.h"
+#include "Types.h"
+
+// Versions of accounts and interests, bumped by writes that change them.
+// Responses of recommend and suggest remember versions they were computed from.
+class ResultVersions {
+   public:
+    // one version for every value of InterestId
+    static constexpr int32_t NUM_INTERESTS = 1 << (8 * sizeof(InterestId));
+
+    ResultVersions() : _accounts(MAX_ACCOUNT_ID + 1) {}
+
+    // changes of a write (including version bumps) should go between them
+    void beginWrite() { ++_writeSeq; }
+    void endWrite() { ++_writeSeq; }
+
+    // odd while a write is in progress
+    int64_t getWriteSeq() const { return _writeSeq.load(); }
+
+    void bumpAccount(AccountId id) { ++_accounts[id]; }
+
+    void bumpInterests(const std::vector<InterestId>& interests) {
+        for (auto interestId : interests) {
+            ++_interests[getInterestIndex(interestId)];
+        }
+    }
+
+    // e.g. indexes are rebuilt
+    void bumpAll() { ++_global; }
+
+    int32_t getAccount(AccountId id) const { return _accounts[id].load(); }
+    int32_t getInterest(InterestId interestId) const {
+        return _interests[getInterestIndex(interestId)].load();
+    }
+    int32_t getGlobal() const { return _global.load(); }
+
+   private:
+    static int32_t getInterestIndex(InterestId interestId) {
+        return static_cast<uint8_t>(interestId);
+    }
+
+    std::atomic<int64_t> _writeSeq{0};
+    std::atomic<int32_t> _global{0};
+    std::vector<std::atomic<int32_t>> _accounts;
+    std::array<std::atomic<int32_t>, NUM_INTERESTS> _interests{};
+};
+
+// what a response was computed from, collected while computing it
+struct ResultDependencies {
+    std::vector<AccountId> accounts;
+    std::vector<InterestId> interests;
+};
+
+// Serialized responses of recommend and suggest. Unlike QueryCache they survive writes:
+// a response is used while none of the accounts and interests it depends on has changed.
+class ResultCache {
+   public:
+    // returns true if response with the same versions of dependencies is found
+    bool get(const std::string& key, const ResultVersions& versions, std::string* body) {
+        if (!ENABLE_RESULT_CACHE) {
+            return false;
+        }
+        auto& shard = getShard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto ptr = stl::mapGetPtr(shard.entries, key);
+        if (!ptr || !ptr->isValid(versions)) {
+            return false;
+        }
+        *body = ptr->body;
+        return true;
+    }
+
+    // writeSeq should be taken before the response started computing
+    void put(const std::string& key, int64_t writeSeq, ResultDependencies& dependencies,
+             const ResultVersions& versions, const std::string& body) {
+        if (!ENABLE_RESULT_CACHE) {
+            return;
+        }
+        Entry entry;
+        entry.body = body;
+        entry.global = versions.getGlobal();
+        auto& accounts = dependencies.accounts;
+        std::sort(accounts.begin(), accounts.end());
+        accounts.erase(std::unique(accounts.begin(), accounts.end()), accounts.end());
+        entry.accounts.reserve(accounts.size());
+        for (auto id : accounts) {
+            entry.accounts.emplace_back(id, versions.getAccount(id));
+        }
+        for (auto interestId : dependencies.interests) {
+            entry.interests.emplace_back(interestId, versions.getInterest(interestId));
+        }
+        if (writeSeq % 2 != 0 || versions.getWriteSeq() != writeSeq) {
+            // there were writes while computing the response
+            return;
+        }
+
+        auto& shard = getShard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.entries.size() >= MAX_SHARD_SIZE) {
+            shard.entries.clear();
+        }
+        shard.entries[key] = std::move(entry);
+    }
+
+   private:
+    static constexpr int NUM_SHARDS = 16;
+    static constexpr size_t MAX_SHARD_SIZE = RESULT_CACHE_MAX_SIZE / NUM_SHARDS;
+
+    struct Entry {
+        std::string body;
+        int32_t global{0};
+        std::vector<std::pair<AccountId, int32_t>> accounts;
+        std::vector<std::pair<InterestId, int32_t>> interests;
+
+        bool isValid(const ResultVersions& versions) const {
+            if (versions.getGlobal() != global) {
+                return false;
+            }
+            for (const auto& [id, version] : accounts) {
+                if (versions.getAccount(id) != version) {
+                    return false;
+                }
+            }
+            for (const auto& [interestId, version] : interests) {
+                if (versions.getInterest(interestId) != version) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, Entry> entries;
+    };
+
+    Shard& getShard(const std::string& key) {
+        return _shards[std::hash<std::string>()(key) % NUM_SHARDS];
+    }
+
+    std::array<Shard, NUM_SHARDS> _shards;
+};
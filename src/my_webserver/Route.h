@@ -51,6 +51,14 @@ class EpollServerAdapter {
         RequestParams params;
         getRequestParams(params, req);
 
+        auto cacheKey = QueryCache::getKey("filter", params);
+        auto epoch = server->writeEpoch.load();
+        std::string body;
+        if (server->queryCache.get(cacheKey, epoch, &body)) {
+            replyWithResponse(body, res);
+            return;
+        }
+
         json j;
         try {
             int32_t limit = extractLimitParam(params);
@@ -60,7 +68,9 @@ class EpollServerAdapter {
             BadRequest400(HTTP_GET, res);
             return;
         }
-        replyWithResponse(j, res);
+        body = j.dump();
+        server->queryCache.put(cacheKey, epoch, body);
+        replyWithResponse(body, res);
     }
 
     void groupAPI(const http_request& req, http_response& res) {
@@ -70,6 +80,14 @@ class EpollServerAdapter {
         RequestParams params;
         getRequestParams(params, req);
 
+        auto cacheKey = QueryCache::getKey("group", params);
+        auto epoch = server->writeEpoch.load();
+        std::string body;
+        if (server->queryCache.get(cacheKey, epoch, &body)) {
+            replyWithResponse(body, res);
+            return;
+        }
+
         json j;
         try {
             int32_t limit = extractLimitParam(params);
@@ -84,6 +102,31 @@ class EpollServerAdapter {
             BadRequest400(HTTP_GET, res);
             return;
         }
+        body = j.dump();
+        server->queryCache.put(cacheKey, epoch, body);
+        replyWithResponse(body, res);
+    }
+
+    void explainAPI(const http_request& req, http_response& res, bool isGroup) {
+        MY_LOG(INFO_LEVEL, "handle explain API");
+        bumpTotalRequests();
+
+        RequestParams params;
+        getRequestParams(params, req);
+
+        json j;
+        try {
+            int32_t limit = extractLimitParam(params);
+            if (isGroup) {
+                server->groupExplainAPI(j, params, limit);
+            } else {
+                server->filterExplainAPI(j, params, limit);
+            }
+        } catch (std::runtime_error& e) {
+            MY_LOG(INFO_LEVEL, "Got error: \"" << e.what() << "\" while processing explain API");
+            BadRequest400(HTTP_GET, res);
+            return;
+        }
         replyWithResponse(j, res);
     }
 
@@ -99,16 +142,27 @@ class EpollServerAdapter {
         RequestParams params;
         getRequestParams(params, req);
 
+        auto cacheKey = QueryCache::getKey("recommend/" + std::to_string(accountId), params);
+        std::string body;
+        if (server->resultCache.get(cacheKey, server->resultVersions, &body)) {
+            replyWithResponse(body, res);
+            return;
+        }
+        auto writeSeq = server->resultVersions.getWriteSeq();
+
         json j;
+        ResultDependencies dependencies;
         try {
             int32_t limit = extractLimitParam(params);
-            server->recommendAPI(j, accountId, limit, params);
+            server->recommendAPI(j, accountId, limit, params, &dependencies);
         } catch (std::runtime_error& e) {
             MY_LOG(INFO_LEVEL, "Got error: \"" << e.what() << "\" while processing recommend API");
             BadRequest400(HTTP_GET, res);
             return;
         }
-        replyWithResponse(j, res);
+        body = j.dump();
+        server->resultCache.put(cacheKey, writeSeq, dependencies, server->resultVersions, body);
+        replyWithResponse(body, res);
     }
 
     void suggestAPI(const http_request& req, http_response& res, AccountId accountId) {
@@ -123,16 +177,27 @@ class EpollServerAdapter {
         RequestParams params;
         getRequestParams(params, req);
 
+        auto cacheKey = QueryCache::getKey("suggest/" + std::to_string(accountId), params);
+        std::string body;
+        if (server->resultCache.get(cacheKey, server->resultVersions, &body)) {
+            replyWithResponse(body, res);
+            return;
+        }
+        auto writeSeq = server->resultVersions.getWriteSeq();
+
         json j;
+        ResultDependencies dependencies;
         try {
             int32_t limit = extractLimitParam(params);
-            server->suggestAPI(j, accountId, limit, params);
+            server->suggestAPI(j, accountId, limit, params, &dependencies);
         } catch (std::runtime_error& e) {
             MY_LOG(INFO_LEVEL, "Got error: \"" << e.what() << "\" while processing suggest API");
             BadRequest400(HTTP_GET, res);
             return;
         }
-        replyWithResponse(j, res);
+        body = j.dump();
+        server->resultCache.put(cacheKey, writeSeq, dependencies, server->resultVersions, body);
+        replyWithResponse(body, res);
     }
 
     void likesAPI(const http_request& req, http_response& res) {
@@ -152,8 +217,9 @@ class EpollServerAdapter {
         }
     }
 
-    void replyWithResponse(const json& j, http_response& res) {
-        std::string j_str = j.dump();
+    void replyWithResponse(const json& j, http_response& res) { replyWithResponse(j.dump(), res); }
+
+    void replyWithResponse(const std::string& j_str, http_response& res) {
         sprintf(res.response_buf, "%s", j_str.c_str());
 
         iovec* iov = res.iov;
@@ -261,6 +327,15 @@ void Route(EpollServerAdapter* adapter, HttpData& data) {
                 return;
             }
         } else if (num_parts == 3) {
+            if (STRINGS_EQUAL(parts[2], "explain")) {
+                if (STRINGS_EQUAL(parts[1], "filter")) {
+                    adapter->explainAPI(data.req, data.res, /* isGroup */ false);
+                    return;
+                } else if (STRINGS_EQUAL(parts[1], "group")) {
+                    adapter->explainAPI(data.req, data.res, /* isGroup */ true);
+                    return;
+                }
+            }
             if (!GetUint32(parts[1], &id)) {
                 NotFound404(data.method, data.res);
                 return;
@@ -1,16 +1,37 @@
 #pragma once
 
 #include "Base.h"
+#include "BatchApplier.h"
 #include "Filter.h"
 #include "Group.h"
 #include "IndexLoader.h"
 #include "MemoryUsage.h"
+#include "QueryCache.h"
 #include "QueryOptimizer.h"
+#include "ResultCache.h"
 #include "Timer.h"
 #include "Types.h"
 #include "Util.h"
 #include "Semaphore.h"
-
+#include "WorkerPool.h"
+
+// Buffers of recommend and suggest requests, taken from ScratchPool for a request
+// so that nothing is allocated per request.
+struct RequestScratch {
+    // suggest
+    EpochArray<double> similarity;
+    // liked by me or already taken
+    EpochArray<char> excluded;
+    std::vector<std::pair<double, AccountId>> mostSimilar;
+    std::vector<AccountId> perSimilarUserResults;
+    // recommend
+    EpochArray<int32_t> numCommonInterests;
+    std::vector<CompatibilityInput> candidates;
+    std::vector<std::vector<CompatibilityInput>> byNumInterests;
+    std::vector<char> isMyInterest;
+    std::vector<std::vector<CompatibilityInput>> candidatesAtBucket =
+        std::vector<std::vector<CompatibilityInput>>(BUCKETS_CNT);
+};
 
 class Server {
    public:
@@ -18,7 +39,56 @@ class Server {
 
     void loadDataFromDirectory(const std::string& dir) { loader.loadDataFromDirectory(dir); }
 
-    void rebuildIndexes() { loader.rebuildIndexes(); }
+    // shapes of group queries since start become the profile of the next start
+    void saveGroupProfile() {
+        std::string tmpFileName = std::string(GROUP_PROFILE_FILE) + ".tmp";
+        std::ofstream output(tmpFileName);
+        auto numShapes = groupShapes.dump(output);
+        output.close();
+        if (numShapes == 0 || !output) {
+            // keep the previous profile
+            std::remove(tmpFileName.c_str());
+            return;
+        }
+        if (std::rename(tmpFileName.c_str(), GROUP_PROFILE_FILE) != 0) {
+            MY_LOG(ERROR_LEVEL, "Failed to save group profile " << GROUP_PROFILE_FILE);
+            return;
+        }
+        MY_LOG(ALWAYS_LOG, "Saved " << numShapes << " group shapes to " << GROUP_PROFILE_FILE);
+    }
+
+    void rebuildIndexes() {
+        saveGroupProfile();
+        // sorted views are rebuilt from cached groups
+        groupUpdates.waitAllApplied();
+        resultVersions.beginWrite();
+        {
+            std::unique_lock<std::shared_mutex> lock(cachedGroupsMutex);
+            loader.rebuildIndexes();
+        }
+        // lookup results might change after rebuild
+        resultVersions.bumpAll();
+        resultVersions.endWrite();
+        bumpWriteEpoch();
+    }
+
+    void bumpWriteEpoch() { ++writeEpoch; }
+
+    void updateCachedGroups(const AccountData& data, int delta) {
+        if (ASYNC_GROUP_UPDATES) {
+            groupUpdates.push(GroupDelta{copyGroupFields(data), delta});
+        } else {
+            std::unique_lock<std::shared_mutex> lock(cachedGroupsMutex);
+            loader.updateCachedGroupResult(data, delta);
+        }
+    }
+
+    void applyGroupUpdates(std::vector<GroupDelta>& batch) {
+        std::unique_lock<std::shared_mutex> lock(cachedGroupsMutex);
+        for (const auto& update : batch) {
+            loader.updateCachedGroupResult(update.data, update.delta);
+        }
+    }
 
     void selectFields(AccountId id, json& j, const SelectedFields& fields) {
         if (!isValidId(id)) {
@@ -91,8 +161,9 @@ class Server {
         return false;
     }
 
-    void suggestAPI(json& j, AccountId accountId, int32_t limit, const RequestParams& params) {
-        auto ids = suggestByLikes(accountId, limit, params);
+    void suggestAPI(json& j, AccountId accountId, int32_t limit, const RequestParams& params,
+                    ResultDependencies* dependencies = nullptr) {
+        auto ids = suggestByLikes(accountId, limit, params, dependencies);
 
         // construct response
         j["accounts"] = json::array();
@@ -112,16 +183,30 @@ class Server {
     }
 
     std::vector<AccountId> suggestByLikes(AccountId myAccountId, int32_t limit,
-                                          const RequestParams& params) {
+                                          const RequestParams& params,
+                                          ResultDependencies* dependencies) {
         auto locationFilter = LocationFilter::parse(params, index);
         MY_ASSERT(isValidAccount(myAccountId));
         const auto* data = &index.accountsArray[myAccountId];
+        auto scratch = scratchPool.acquire();
+        auto& similarity = scratch->similarity;
+        auto& excluded = scratch->excluded;
+        auto& mostSimilar = scratch->mostSimilar;
+        auto& perSimilarUserResults = scratch->perSimilarUserResults;
+        similarity.startEpoch();
+        excluded.startEpoch();
+        if (dependencies) {
+            // backward likes of liked accounts are changed by likes of them
+            dependencies->accounts.push_back(myAccountId);
+            for (const auto& edge : data->likes) {
+                dependencies->accounts.push_back(edge.accountId);
+            }
+        }
+
         // go through all likes of given myAccountId
         // and accumulate similarity over ids
         // A --> B <-- [X, Y]
         // A --> C <-- [Z]
-        std::unordered_map<AccountId, double> similarity;
-        std::unordered_set<AccountId> likedByMe;
 
         for (const auto& edge : data->likes) {
             // std::cout << " looking at next: " << nextId << std::endl;
@@ -133,7 +218,7 @@ class Server {
             }
             auto* nextData = &index.accountsArray[edge.accountId];
 
-            likedByMe.insert(edge.accountId);
+            excluded[edge.accountId] = true;
             // find all potential candidates that also liked "B"
             for (const auto& backwardEdge : nextData->backwardLikes) {
                 // std::cout << nextId << " was also liked by " << similarUserId
@@ -145,25 +230,29 @@ class Server {
                     // skip yourself
                     continue;
                 }
-                // TODO: use average
+                // both are averages of repeated likes
                 double likeDiff = std::abs(edge.ts - backwardEdge.ts);
                 double value = (likeDiff < constants::EPSILON) ? 1.0 : 1.0 / likeDiff;
                 similarity[backwardEdge.accountId] += value;
             }
         }
 
-        // sort most similar users in reversed order
-        std::vector<std::pair<double, AccountId>> mostSimilar;
-        mostSimilar.reserve(similarity.size());
-        for (const auto& [otherId, value] : similarity) {
-            mostSimilar.emplace_back(value, otherId);
+        // most similar users go first, only the ones needed are taken from the heap
+        mostSimilar.clear();
+        for (auto otherId : similarity.getTouched()) {
+            mostSimilar.emplace_back(similarity[otherId], otherId);
         }
-        std::sort(mostSimilar.rbegin(), mostSimilar.rend());
+        std::make_heap(mostSimilar.begin(), mostSimilar.end());
 
         // now iterate through results until we find required number of entries
         std::vector<AccountId> finalResult;
-        std::unordered_set<AccountId> taken;
-        for (const auto& [value, similarUserId] : mostSimilar) {
+        while (!mostSimilar.empty()) {
+            std::pop_heap(mostSimilar.begin(), mostSimilar.end());
+            auto similarUserId = mostSimilar.back().second;
+            mostSimilar.pop_back();
+            if (dependencies) {
+                dependencies->accounts.push_back(similarUserId);
+            }
             auto* similarUserData = &index.accountsArray[similarUserId];
             if (!isValidId(similarUserData->id)) {
                 // probably shouldn't happen
@@ -175,21 +264,24 @@ class Server {
             if (locationFilter && !locationFilter->matches(similarUserId, *similarUserData)) {
                 continue;
             }
-            std::vector<AccountId> perSimilarUserResults;
-            for (const auto& [id, edge] : similarUserData->likes) {
-                if (likedByMe.count(id) > 0) {
-                    // skip the ones already liked by me
-                    continue;
-                }
-                if (taken.count(id) > 0) {
-                    // don't take the same user twice
+            perSimilarUserResults.clear();
+            for (const auto& edge : similarUserData->likes) {
+                auto id = edge.accountId;
+                if (excluded.contains(id)) {
+                    // skip the ones already liked by me, don't take the same user twice
                     continue;
                 }
-                taken.insert(id);
+                excluded[id] = true;
                 perSimilarUserResults.push_back(id);
             }
             // sort by descending likes
             if (!perSimilarUserResults.empty()) {
+                if (dependencies) {
+                    // the response has their data
+                    dependencies->accounts.insert(dependencies->accounts.end(),
+                                                  perSimilarUserResults.begin(),
+                                                  perSimilarUserResults.end());
+                }
                 std::sort(perSimilarUserResults.rbegin(), perSimilarUserResults.rend());
                 finalResult.insert(finalResult.end(), perSimilarUserResults.begin(),
                                    perSimilarUserResults.end());
@@ -204,11 +296,18 @@ class Server {
         return finalResult;
     }
 
-    void recommendAPI(json& j, AccountId accountId, int32_t limit, const RequestParams& params) {
+    void recommendAPI(json& j, AccountId accountId, int32_t limit, const RequestParams& params,
+                      ResultDependencies* dependencies = nullptr) {
         std::vector<AccountId> ids;
         if (ENABLE_RECOMMEND_API) {
             ids = recommendForUser(accountId, limit, params);
         }
+        if (dependencies) {
+            // every candidate (as well as the response) has one of the interests,
+            // so their changes bump versions of these interests
+            dependencies->accounts.push_back(accountId);
+            dependencies->interests = index.accountsArray[accountId].interests;
+        }
         // if (DEBUG_MEMORY_LEAK) {
         //     ids = hackyRecommendForUser(accountId, limit, params);
         // }
@@ -226,11 +325,57 @@ class Server {
         }
     }
 
+    CompatibilityInput createCompatibilityInput(const AccountData& myData, AccountId userId,
+                                                const AccountData& userData,
+                                                int32_t numInterests) {
+        CompatibilityInput input;
+        input.accountId = userId;
+        input.numInterests = numInterests;
+
+        input.ageDifference = std::abs(myData.birth - userData.birth);
+        input.status = userData.status;
+        input.premiumActivated = userData.hasPremiumNow;
+        return input;
+    }
+
+    // candidates are from a single recommend bucket: premium and status are the same,
+    // so they are only ranked by number of common interests first
+    void appendMostCompatible(const std::vector<CompatibilityInput>& candidates, int limit,
+                              std::vector<AccountId>& finalResult, RequestScratch& scratch) {
+        auto& byNumInterests = scratch.byNumInterests;
+        for (auto& compatibility : byNumInterests) {
+            compatibility.clear();
+        }
+        int32_t maxNumInterests = 0;
+        for (const auto& input : candidates) {
+            if (input.numInterests >= byNumInterests.size()) {
+                byNumInterests.resize(input.numInterests + 1);
+            }
+            maxNumInterests = std::max(maxNumInterests, input.numInterests);
+            byNumInterests[input.numInterests].push_back(input);
+        }
+
+        // only sort the best groups up to the limit
+        for (int32_t numInterests = maxNumInterests;
+             numInterests > 0 && finalResult.size() < limit; --numInterests) {
+            auto& compatibility = byNumInterests[numInterests];
+            auto numTaken = std::min<size_t>(limit - finalResult.size(), compatibility.size());
+            std::partial_sort(compatibility.begin(), compatibility.begin() + numTaken,
+                              compatibility.end());
+            for (int i = 0; i < numTaken; ++i) {
+                finalResult.push_back(compatibility[i].accountId);
+            }
+        }
+    }
+
     void appendFromBreakdown(AccountId myId, const AccountData& myData,
                              const UsersAtIntIndex& usersAtInterestId,
                              std::unique_ptr<Filter>& locationFilter, int limit,
-                             std::vector<AccountId>& finalResult) {
-        std::unordered_map<AccountId, int32_t> numCommonInterests;
+                             std::vector<AccountId>& finalResult, RequestScratch& scratch) {
+        auto& numCommonInterests = scratch.numCommonInterests;
+        auto& candidates = scratch.candidates;
+
+        numCommonInterests.startEpoch();
         for (const auto& interestId : myData.interests) {
             MY_ASSERT(interestId < usersAtInterestId.size());
             for (const auto& userId : usersAtInterestId[interestId]) {
@@ -238,34 +383,89 @@ class Server {
                     // skip yourself
                     continue;
                 }
-                numCommonInterests[userId] += 1;
+                ++numCommonInterests[userId];
             }
         }
 
-        std::vector<CompatibilityInput> compatiblity;
-        for (const auto& [userId, numInterests] : numCommonInterests) {
+        candidates.clear();
+        for (auto userId : numCommonInterests.getTouched()) {
             const auto& userData = index.accountsArray[userId];
             MY_ASSERT(isValidId(userData.id));
             if (locationFilter && !locationFilter->matches(userId, userData)) {
                 // take only the ones that match country/city
                 continue;
             }
+            candidates.push_back(createCompatibilityInput(
+                myData, userId, userData, numCommonInterests[userId]));
+        }
+        appendMostCompatible(candidates, limit, finalResult, scratch);
+    }
 
-            auto& input = compatiblity.emplace_back();
-            input.accountId = userId;
-            input.numInterests = numInterests;
+    // Goes through accounts of the location instead of the interests, splitting candidates
+    // by recommend buckets at once. Cheaper when there are few accounts in the location.
+    // Candidates are bucketed by their current premium and status and include accounts that
+    // moved into the location, while recommendBuckets are only rebuilt, so until the next
+    // rebuild the answer may differ from the one of appendFromBreakdown.
+    void collectFromLocation(AccountId myId, const AccountData& myData, Filter* locationFilter,
+                             RequestScratch& scratch) {
+        auto& isMyInterest = scratch.isMyInterest;
+        auto& candidatesAtBucket = scratch.candidatesAtBucket;
+        isMyInterest.assign(index.interestIdMap.size(), false);
+        for (auto interestId : myData.interests) {
+            isMyInterest[interestId] = true;
+        }
+        for (auto& candidates : candidatesAtBucket) {
+            candidates.clear();
+        }
 
-            input.ageDifference = std::abs(myData.birth - userData.birth);
-            input.status = userData.status;
-            input.premiumActivated = userData.hasPremiumNow;
+        auto matchingSex = getOppositeSexEnum(myData.sexEnum);
+        std::array<AccountId, LOOKUP_BLOCK_SIZE> ids;
+        auto iterator = locationFilter->findRemainingItems();
+        while (auto filled = iterator->fillBlock(ids.data(), ids.size())) {
+            for (int32_t i = 0; i < filled; ++i) {
+                auto userId = ids[i];
+                const auto& userData = index.accountsArray[userId];
+                if (userId == myId || userData.sexEnum != matchingSex) {
+                    continue;
+                }
+                if (!locationFilter->matches(userId, userData)) {
+                    // moved since the index was built
+                    continue;
+                }
+                int32_t numInterests = 0;
+                for (auto interestId : userData.interests) {
+                    if (interestId < isMyInterest.size() && isMyInterest[interestId]) {
+                        ++numInterests;
+                    }
+                }
+                if (numInterests == 0) {
+                    continue;
+                }
+                auto bin = getRecommendBucket(userData.sexEnum, userData.hasPremiumNow,
+                                              userData.status);
+                candidatesAtBucket[bin].push_back(
+                    createCompatibilityInput(myData, userId, userData, numInterests));
+            }
         }
-        std::sort(compatiblity.begin(), compatiblity.end());
+    }
 
-        //
-        for (int i = 0; finalResult.size() < limit && i < compatiblity.size(); ++i) {
-            const auto& c = compatiblity[i];
-            finalResult.push_back(c.accountId);
+    // number of ids in recommend buckets of the interests
+    int64_t estimateBreakdownSize(const AccountData& myData) {
+        auto matchingSex = getOppositeSexEnum(myData.sexEnum);
+        int64_t result = 0;
+        for (int premiumNow = 0; premiumNow < PREMIUM_CNT; ++premiumNow) {
+            for (int status = 0; status < STATUS_CNT; ++status) {
+                auto bin =
+                    getRecommendBucket(matchingSex, (bool)premiumNow, static_cast<Status>(status));
+                const auto& usersAtInterestId = index.recommendBuckets[bin];
+                for (auto interestId : myData.interests) {
+                    if (interestId < usersAtInterestId.size()) {
+                        result += usersAtInterestId[interestId].size();
+                    }
+                }
+            }
         }
+        return result;
     }
 
     std::vector<AccountId> recommendForUser(AccountId myId, int32_t limit,
@@ -281,14 +481,26 @@ class Server {
         std::vector<AccountId> finalResult;
         finalResult.reserve(limit);
 
+        auto scratch = scratchPool.acquire();
+        bool fromLocation = locationFilter && locationFilter->supportsLookup() &&
+                            locationFilter->estimateOutputSize() < estimateBreakdownSize(myData);
+        if (fromLocation) {
+            collectFromLocation(myId, myData, locationFilter.get(), *scratch);
+        }
+
         auto matchingSex = getOppositeSexEnum(myData.sexEnum);
         for (int premiumNow = 1; premiumNow >= 0; --premiumNow) {
             for (int status = 0; status < STATUS_CNT; ++status) {
                 auto bin =
                     getRecommendBucket(matchingSex, (bool)premiumNow, static_cast<Status>(status));
-                const auto& usersAtInterestId = index.recommendBuckets[bin];
-                appendFromBreakdown(myId, myData, usersAtInterestId, locationFilter, limit,
-                                    finalResult);
+                if (fromLocation) {
+                    appendMostCompatible(scratch->candidatesAtBucket[bin], limit, finalResult,
+                                         *scratch);
+                } else {
+                    const auto& usersAtInterestId = index.recommendBuckets[bin];
+                    appendFromBreakdown(myId, myData, usersAtInterestId, locationFilter, limit,
+                                        finalResult, *scratch);
+                }
                 if (finalResult.size() >= limit) {
                     return finalResult;
                 }
@@ -333,8 +545,12 @@ class Server {
     // }
 
     // returns true if success
-    bool tryOptimizedFilterQuery(FilterList* filterList, std::vector<AccountId>* ids) {
-        auto optimizedFilter = rewriteFilters(filterList->filters);
+    bool tryOptimizedFilterQuery(FilterList* filterList, std::vector<AccountId>* ids,
+                                 QueryPlan* plan = nullptr) {
+        auto optimizedFilter = rewriteFilters(filterList->filters, plan);
+        if (plan) {
+            plan->finishStage("plan");
+        }
         if (!optimizedFilter) {
             return false;
         }
@@ -343,47 +559,89 @@ class Server {
         if (optimizedFilter->lookupFilter->name == "interests") {
             checkLookup = true;
         }
-        auto idIterator = optimizedFilter->lookupFilter->findRemainingItems();
-        // std::cout << "running optimized query with lookup, size = " << idIterator->size();
-        for (; idIterator->valid(); idIterator->next()) {
-            auto id = idIterator->getId();
-            const auto& data = index.accountsArray[id];
-            if (isValidId(data.id)) {
-                if (checkLookup) {
-                    // skip the ones that doesn't match lookup
-                    if (!optimizedFilter->lookupFilter->matches(id, data)) {
-                        continue;
-                    }
+        auto examined = runLookupInBlocks(index, optimizedFilter.get(), checkLookup,
+                                          filterList->limit, [&](AccountId id) {
+                                              ids->push_back(id);
+                                              return ids->size() < filterList->limit;
+                                          });
+        if (plan) {
+            plan->strategy = "lookup";
+            plan->rowsExamined = examined;
+            plan->rowsMatched = ids->size();
+            plan->finishStage("execute");
+        }
+        return true;
+    }
+
+    // Iterates through accounts backwards, split into ranges scanned in parallel.
+    // Each range collects up to limit ids; once a range has found limit ids, smaller ids than
+    // the last of them can't get into the result, so all ranges stop there.
+    // Returns number of examined accounts.
+    int32_t parallelFilterScan(FilterList* filterList, int32_t limit, std::vector<AccountId>* ids) {
+        std::vector<std::vector<AccountId>> partialIds(NUM_SCAN_PARTITIONS);
+        std::atomic<AccountId> cutoffId{0};
+        std::atomic<int32_t> examined{0};
+
+        scanPool.parallelFor(NUM_SCAN_PARTITIONS, [&](int32_t partition) {
+            auto& partial = partialIds[partition];
+            int32_t partitionExamined = 0;
+            FOR_EACH_ACCOUNT_ID_IN_PARTITION(id, partition) {
+                if (id < cutoffId.load(std::memory_order_relaxed)) {
+                    break;
                 }
-                if (optimizedFilter->matches(id, data)) {
-                    ids->push_back(id);
-                    if (ids->size() >= filterList->limit) {
+                TRY_GET_CONST_DATA(id, data);
+                ++partitionExamined;
+                if (filterList->matches(id, data)) {
+                    partial.push_back(id);
+                    if (partial.size() >= limit) {
+                        auto prev = cutoffId.load();
+                        while (prev < id && !cutoffId.compare_exchange_weak(prev, id)) {
+                        }
                         break;
                     }
                 }
             }
+            examined += partitionExamined;
+        });
+
+        for (const auto& partial : partialIds) {
+            for (auto id : partial) {
+                if (ids->size() >= limit) {
+                    return examined;
+                }
+                ids->push_back(id);
+            }
         }
-        return true;
+        return examined;
     }
 
-    void filterAPI(json& j, const RequestParams& params, int32_t limit) {
+    // plan is only filled for explain API
+    void filterAPI(json& j, const RequestParams& params, int32_t limit,
+                   QueryPlan* plan = nullptr) {
+        if (plan) {
+            plan->start();
+        }
         auto filterList = FilterList::parse(params, index);
         filterList->limit = limit;
+        if (plan) {
+            plan->finishStage("parse");
+        }
 
         std::vector<AccountId> ids;
         ids.reserve(limit);
 
-        if (!tryOptimizedFilterQuery(filterList.get(), &ids)) {
+        if (!tryOptimizedFilterQuery(filterList.get(), &ids, plan)) {
             // default case
-            // iterate through accounts backwards
-            for (int id = MAX_ACCOUNT_ID; id > 0; --id) {
-                TRY_GET_CONST_DATA(id, data);
-                if (filterList->matches(id, data)) {
-                    ids.push_back(id);
-                    if (ids.size() >= limit) {
-                        break;
-                    }
+            auto examined = parallelFilterScan(filterList.get(), limit, &ids);
+            if (plan) {
+                plan->strategy = "full_scan";
+                plan->estimatedRows = MAX_ACCOUNT_ID;
+                plan->rowsExamined = examined;
+                plan->rowsMatched = ids.size();
+                for (const auto& filter : filterList->filters) {
+                    plan->residualFilters.push_back(filter->name);
                 }
+                plan->finishStage("execute");
             }
         }
 
@@ -403,26 +661,149 @@ class Server {
 
             j["accounts"].push_back(object);
         }
+        if (plan) {
+            plan->finishStage("serialize");
+        }
     }
 
-    void groupAPI(json& j, const RequestParams& params, int32_t limit) {
-        auto groupList = GroupList::parse(params, index);
-        GroupAggregationMap map;
+    void filterExplainAPI(json& j, const RequestParams& params, int32_t limit) {
+        QueryPlan plan;
+        json result;
+        filterAPI(result, params, limit, &plan);
+        plan.toJson(j["plan"]);
+        j["result_size"] = result["accounts"].size();
+    }
 
-        GroupOptimizer groupOptimizer(index, &map);
-        groupOptimizer.aggregateIntoMap(groupList.get());
+    // Queries without filters are read from the view already sorted in the right order.
+    bool tryReadSortedGroupView(const GroupList* groupList, int32_t limit,
+                                std::vector<GroupSortingItem>* result, QueryPlan* plan) {
+        if (!groupList->filters.empty()) {
+            return false;
+        }
+        // fields are in the order of keys param at this point
+        int32_t keys = 0;
+        for (const auto& field : groupList->groupFields) {
+            keys = appendGroupFieldOrder(keys, field->mask);
+        }
+        auto view = loader.getSortedGroupView(keys);
+        if (!view) {
+            return false;
+        }
 
-        std::vector<GroupSortingItem> result;
-        result.reserve(map.size());
-        for (const auto& [key, item] : map) {
-            result.emplace_back(item, groupList->groupFieldTypes, index);
+        bool valid =
+            view->forEachInOrder(groupList->increasingOrder, [&](GroupKey key, int32_t count) {
+                result->emplace_back(key, count, *view->getMap(), groupList->groupFieldTypes,
+                                     index);
+                return result->size() < limit;
+            });
+        if (!valid) {
+            return false;
         }
+        if (plan) {
+            plan->strategy = "sorted_view";
+            plan->cacheKey = groupList->getFieldNames();
+            plan->rowsExamined = result->size();
+            plan->rowsMatched = result->size();
+        }
+        return true;
+    }
 
+    // Selects limit best groups comparing precomputed ranks of values,
+    // strings are only built for selected groups.
+    // Returns false if some of the values don't have rank.
+    bool selectTopGroups(const GroupList* groupList, const GroupAggregationMap& map,
+                         int32_t limit, std::vector<GroupSortingItem>* result) {
+        const auto& types = map.getTypes();
+        std::vector<int32_t> positions;
+        positions.reserve(groupList->groupFieldTypes.size());
+        for (auto groupType : groupList->groupFieldTypes) {
+            auto it = std::find(types.begin(), types.end(), groupType);
+            MY_ASSERT(it != types.end());
+            positions.push_back(it - types.begin());
+        }
+
+        std::vector<GroupRankedItem> items;
+        items.reserve(map.size());
+        bool allRanked = true;
+        map.forEach([&](GroupKey key, int32_t count) {
+            // empty groups are never returned
+            if (!allRanked || count == 0) {
+                return;
+            }
+            items.emplace_back(key, count);
+            allRanked = items.back().fillRanks(map, positions, index);
+        });
+        if (!allRanked) {
+            return false;
+        }
+
+        auto middle = items.begin() + std::min<int32_t>(limit, items.size());
         if (groupList->increasingOrder) {
-            std::sort(result.begin(), result.end());
+            std::partial_sort(items.begin(), middle, items.end());
+        } else {
+            std::partial_sort(items.begin(), middle, items.end(),
+                              [](const auto& a, const auto& b) { return b < a; });
+        }
+        result->reserve(middle - items.begin());
+        for (auto it = items.begin(); it != middle; ++it) {
+            result->emplace_back(it->key, it->count, map, groupList->groupFieldTypes, index);
+        }
+        return true;
+    }
+
+    // plan is only filled for explain API
+    void groupAPI(json& j, const RequestParams& params, int32_t limit,
+                  QueryPlan* plan = nullptr) {
+        if (plan) {
+            plan->start();
+        }
+        auto groupList = GroupList::parse(params, index);
+        if (plan) {
+            plan->finishStage("parse");
+        } else if (auto shape = groupList->getCombinedFieldsMask()) {
+            // explain queries are not part of the workload
+            groupShapes.record(shape);
+        }
+        // cached groups should include all writes made before the query
+        groupUpdates.waitAllApplied();
+        if (plan) {
+            plan->finishStage("wait_group_updates");
+        }
+
+        std::vector<GroupSortingItem> result;
+        // cached maps are read in place, writes made since the wait are applied after the query
+        std::shared_lock<std::shared_mutex> cachedGroupsLock(cachedGroupsMutex);
+        if (tryReadSortedGroupView(groupList.get(), limit, &result, plan)) {
+            if (plan) {
+                plan->finishStage("read_sorted_view");
+            }
         } else {
-            std::sort(result.rbegin(), result.rend());
+            GroupAggregationMap map;
+            GroupOptimizer groupOptimizer(index, &map, &scanPool, plan);
+            groupOptimizer.aggregateIntoMap(groupList.get());
+            const auto& resultMap = *groupOptimizer.result;
+            if (plan) {
+                plan->finishStage("aggregate");
+            }
+
+            if (!selectTopGroups(groupList.get(), resultMap, limit, &result)) {
+                // values added after the last rebuild don't have ranks yet
+                result.reserve(resultMap.size());
+                resultMap.forEach([&](GroupKey key, int32_t count) {
+                    result.emplace_back(key, count, resultMap, groupList->groupFieldTypes, index);
+                });
+
+                if (groupList->increasingOrder) {
+                    std::sort(result.begin(), result.end());
+                } else {
+                    std::sort(result.rbegin(), result.rend());
+                }
+            }
+            if (plan) {
+                plan->finishStage("sort");
+            }
         }
+        cachedGroupsLock.unlock();
 
         j["groups"] = json::array();
         // j["groups"].reserve(limit);
@@ -447,6 +828,17 @@ class Server {
             ++numFound;
             j["groups"].push_back(object);
         }
+        if (plan) {
+            plan->finishStage("serialize");
+        }
+    }
+
+    void groupExplainAPI(json& j, const RequestParams& params, int32_t limit) {
+        QueryPlan plan;
+        json result;
+        groupAPI(result, params, limit, &plan);
+        plan.toJson(j["plan"]);
+        j["result_size"] = result["groups"].size();
     }
 
     bool isValidAccount(AccountId id) {
@@ -557,11 +949,16 @@ class Server {
         }
 
         ScopedSemaphore scope(_updateMutex);
+        resultVersions.beginWrite();
         // if everything is ok process those likes:
         for (const auto& l : likes) {
-            index.accountsArray[l.liker].likes.emplace_back(l.likee, l.ts);
-            index.accountsArray[l.likee].backwardLikes.emplace_back(l.liker, l.ts);
+            addLikeEdge(index.accountsArray[l.liker].likes, l.likee, l.ts);
+            addLikeEdge(index.accountsArray[l.likee].backwardLikes, l.liker, l.ts);
+            resultVersions.bumpAccount(l.liker);
+            resultVersions.bumpAccount(l.likee);
         }
+        resultVersions.endWrite();
+        bumpWriteEpoch();
 
         return true;
     }
@@ -588,19 +985,27 @@ class Server {
         //
         // index.accountsArray[data.id].id = data.id;
         ScopedSemaphore scope(_updateMutex);
+        resultVersions.beginWrite();
         auto& data = index.accountsArray[id];
         data.id = id;
         loader.loadAccountData(j, data);
 
         // backward likes need to updated manually
         for (const auto& likeEdge : data.likes) {
-            index.accountsArray[likeEdge.accountId].backwardLikes.emplace_back(id, likeEdge.ts);
+            addLikeEdge(index.accountsArray[likeEdge.accountId].backwardLikes, id, likeEdge.ts,
+                        likeEdge.count);
+            resultVersions.bumpAccount(likeEdge.accountId);
         }
+        resultVersions.bumpAccount(id);
+        resultVersions.bumpInterests(data.interests);
+        resultVersions.endWrite();
 
         // TODO: use mutex?
         index.emails.insert(data.email);
 
-        loader.updateCachedGroupResult(data, ADD_ACCOUNT);
+        loader.updatePremiumIndexes(data, false, false);
+        updateCachedGroups(data, ADD_ACCOUNT);
+        bumpWriteEpoch();
         // if (data.id > maxAccountId) {
         //     maxAccountId = data.id;
         //     MY_LOG(INFO_LEVEL, "now maxAccountId = " << maxAccountId);
@@ -614,6 +1019,7 @@ class Server {
         }
 
         ScopedSemaphore scope(_updateMutex);
+        resultVersions.beginWrite();
         if (j.count("email") > 0) {
             std::string email = j["email"].get<std::string>();
             const std::string prevEmail = index.accountsArray[id].email;
@@ -628,15 +1034,29 @@ class Server {
 
         auto& data = index.accountsArray[id];
 
-        loader.updateCachedGroupResult(data, REMOVE_ACCOUNT);
+        auto oldGroupFields = copyGroupFields(data);
+        bool hadPremium = data.premiumStart > 0;
+        bool hadPremiumNow = data.hasPremiumNow;
 
         loader.loadAccountData(j, data);
         // backward likes need to updated manually
         for (const auto& likeEdge : data.likes) {
-            index.accountsArray[likeEdge.accountId].backwardLikes.emplace_back(id, likeEdge.ts);
+            addLikeEdge(index.accountsArray[likeEdge.accountId].backwardLikes, id, likeEdge.ts,
+                        likeEdge.count);
+            resultVersions.bumpAccount(likeEdge.accountId);
         }
-
-        loader.updateCachedGroupResult(data, ADD_ACCOUNT);
+        resultVersions.bumpAccount(id);
+        // recommends of accounts having old or new interests might change
+        resultVersions.bumpInterests(oldGroupFields.interests);
+        resultVersions.bumpInterests(data.interests);
+        resultVersions.endWrite();
+
+        loader.updatePremiumIndexes(data, hadPremium, hadPremiumNow);
+        if (!haveSameGroupFields(oldGroupFields, data)) {
+            updateCachedGroups(oldGroupFields, REMOVE_ACCOUNT);
+            updateCachedGroups(data, ADD_ACCOUNT);
+        }
+        bumpWriteEpoch();
 
         return true;
     }
@@ -669,11 +1089,33 @@ class Server {
     // using semaphor counter = 1 to simulate mutex
     Semaphore _updateMutex{1};
 
+    // runs full scans in parallel
+    WorkerPool scanPool{NUM_SCAN_WORKERS};
+    // buffers of recommend and suggest shared by the server threads
+    ScratchPool<RequestScratch> scratchPool;
+
+    // responses of filter/group API, invalidated by bumping writeEpoch
+    QueryCache queryCache;
+    std::atomic<int64_t> writeEpoch{0};
+    // responses of recommend/suggest API, invalidated by changes of their dependencies
+    ResultCache resultCache;
+    ResultVersions resultVersions;
+
     // loader
     IndexLoader loader;
     static constexpr int ADD_ACCOUNT = 1;
     static constexpr int REMOVE_ACCOUNT = -1;
 
+    // profile of group queries, see IndexLoader::loadGroupProfile
+    GroupShapeStats groupShapes;
+
+    // cached groups, their sorted views and interest co-occurrence are updated under the
+    // exclusive lock and read by group queries under the shared one
+    std::shared_mutex cachedGroupsMutex;
+    // applies writes to cached groups in the background, see updateCachedGroups
+    BatchApplier<GroupDelta> groupUpdates{
+        [this](std::vector<GroupDelta>& batch) { applyGroupUpdates(batch); }};
+
     // debug json
     std::unordered_map<AccountId, json> jsonDump;
 };
@@ -1,7 +1,11 @@
 #pragma once
 
+#include "BatchApplier.h"
 #include "Iterator.h"
+#include "QueryCache.h"
+#include "ResultCache.h"
 #include "Types.h"
+#include "WorkerPool.h"
 
 namespace tests {
 void runIteratorTests() {
@@ -22,6 +26,127 @@ void runIteratorTests() {
     for (int i = 0; i < c.size(); ++i) {
         MY_ASSERT_EQ(c[i], cExpected[i]);
     }
+
+    AccountIdList x = {20, 15, 10, 7, 5, 2};
+    AccountIdList y = {15, 10, 5, 4, 2};
+    AccountIdList z = {16, 15, 10, 2};
+    std::vector<std::unique_ptr<IdIterator>> iterators;
+    iterators.push_back(std::make_unique<IdListIterator>(x));
+    iterators.push_back(std::make_unique<IdListIterator>(y));
+    iterators.push_back(std::make_unique<IdListIterator>(z));
+    auto multi = std::make_unique<MultiIntersectionIdIterator>(std::move(iterators));
+    MY_ASSERT_EQ(multi->size(), 4);
+
+    AccountIdList m;
+    AccountIdList mExpected = {15, 10, 2};
+    for (; multi->valid(); multi->next()) {
+        m.push_back(multi->getId());
+    }
+    MY_ASSERT_EQ(m.size(), mExpected.size());
+    for (int i = 0; i < m.size(); ++i) {
+        MY_ASSERT_EQ(m[i], mExpected[i]);
+    }
+
+    std::vector<std::unique_ptr<IdIterator>> unionIterators;
+    unionIterators.push_back(std::make_unique<IdListIterator>(x));
+    unionIterators.push_back(std::make_unique<IdListIterator>(z));
+    auto unionIt = std::make_unique<UnionIdIterator>(std::move(unionIterators));
+
+    AccountIdList u;
+    AccountIdList uExpected = {20, 16, 15, 10, 7, 5, 2};
+    for (; unionIt->valid(); unionIt->next()) {
+        u.push_back(unionIt->getId());
+    }
+    MY_ASSERT_EQ(u.size(), uExpected.size());
+    for (int i = 0; i < u.size(); ++i) {
+        MY_ASSERT_EQ(u[i], uExpected[i]);
+    }
+
+    AccountIdList all = {15, 10, 6, 5, 3, 2, 1};
+    AccountIdList excluded = {10, 5, 1};
+    auto difference = std::make_unique<DifferenceIdIterator>(
+        std::make_unique<IdListIterator>(all), std::make_unique<IdListIterator>(excluded));
+    MY_ASSERT_EQ(difference->size(), 4);
+
+    AccountIdList d;
+    AccountIdList dExpected = {15, 6, 3, 2};
+    for (; difference->valid(); difference->next()) {
+        d.push_back(difference->getId());
+    }
+    MY_ASSERT_EQ(d.size(), dExpected.size());
+    for (int i = 0; i < d.size(); ++i) {
+        MY_ASSERT_EQ(d[i], dExpected[i]);
+    }
+}
+void runGroupAggregationMapTests() {
+    std::cout << "Running GroupAggregationMap tests " << std::endl;
+    // small key space is stored as flat array
+    GroupAggregationMap flat;
+    flat.init({GroupFieldType::STATUS, GroupFieldType::FAKE});
+    // the other one is split into blocks
+    GroupAggregationMap table;
+    table.init({GroupFieldType::CITY, GroupFieldType::COUNTRY});
+
+    for (int32_t i = 0; i < 100; ++i) {
+        auto flatKey = appendGroupValue(0, GroupValue{i % 3, GroupFieldType::STATUS});
+        flatKey = appendGroupValue(flatKey, GroupValue{i - 50, GroupFieldType::FAKE});
+        MY_ASSERT(flat.find(flatKey) == nullptr);
+        flat.insert(flatKey, i);
+        MY_ASSERT_EQ(*flat.find(flatKey), i);
+
+        auto tableKey = appendGroupValue(0, GroupValue{i * 300, GroupFieldType::CITY});
+        tableKey = appendGroupValue(tableKey, GroupValue{i, GroupFieldType::COUNTRY});
+        MY_ASSERT(table.find(tableKey) == nullptr);
+        table.insert(tableKey, i);
+        MY_ASSERT_EQ(*table.find(tableKey), i);
+    }
+    MY_ASSERT_EQ(flat.size(), 100);
+    MY_ASSERT_EQ(table.size(), 100);
+
+    int32_t total = 0;
+    flat.forEach([&](GroupKey key, int32_t count) {
+        total += count;
+        MY_ASSERT_EQ(flat.getValue(key, 0).valueId, count % 3);
+        MY_ASSERT_EQ(flat.getValue(key, 1).valueId, count - 50);
+    });
+    table.forEach([&](GroupKey key, int32_t count) {
+        total += count;
+        MY_ASSERT_EQ(table.getValue(key, 0).valueId, count * 300);
+        MY_ASSERT_EQ(table.getValue(key, 1).valueId, count);
+    });
+    MY_ASSERT_EQ(total, 99 * 100);
+
+    // city=300, country=1 without city
+    auto tableKey = appendGroupValue(0, GroupValue{300, GroupFieldType::CITY});
+    tableKey = appendGroupValue(tableKey, GroupValue{1, GroupFieldType::COUNTRY});
+    MY_ASSERT_EQ(table.removeValue(tableKey, 0),
+                 appendGroupValue(0, GroupValue{1, GroupFieldType::COUNTRY}));
+    MY_ASSERT_EQ(table.removeValue(tableKey, 1),
+                 appendGroupValue(0, GroupValue{300, GroupFieldType::CITY}));
+
+    InterestCooccurrence cooccurrence;
+    cooccurrence.init(/* numCountries */ 2);
+    AccountData first;
+    first.interests = {1, 2};
+    first.countryId = 1;
+    AccountData second;
+    second.interests = {2, 3};
+    second.sexEnum = SexEnum::FEMALE;
+    // country created after init
+    second.countryId = 5;
+    cooccurrence.update(first, 1);
+    cooccurrence.update(second, 1);
+
+    std::array<int32_t, InterestCooccurrence::MAX_INTERESTS> row{};
+    MY_ASSERT(cooccurrence.addRow(INVALID_ID, INVALID_ID, INVALID_ID, 2, row.data()));
+    MY_ASSERT_EQ(row[1], 1);
+    MY_ASSERT_EQ(row[2], 2);
+    MY_ASSERT_EQ(row[3], 1);
+    row.fill(0);
+    MY_ASSERT(cooccurrence.addRow(INVALID_ID, INVALID_ID, 1, 2, row.data()));
+    MY_ASSERT_EQ(row[2], 1);
+    MY_ASSERT_EQ(row[3], 0);
+    MY_ASSERT(!cooccurrence.addRow(INVALID_ID, INVALID_ID, 5, 2, row.data()));
 }
 }  // namespace tests
 
@@ -32,5 +157,144 @@ void runTests() {
     MY_ASSERT_EQ(convertSexToString(getOppositeSexEnum(SexEnum::MALE)), "f");
     MY_ASSERT_EQ(convertSexToString(getOppositeSexEnum(SexEnum::FEMALE)), "m");
 
+    AccountIdList sortedIds = {10, 5, 1};
+    insertAccountId(sortedIds, 7);
+    insertAccountId(sortedIds, 5);
+    eraseAccountId(sortedIds, 10);
+    MY_ASSERT_EQ(sortedIds.size(), 3);
+    MY_ASSERT_EQ(sortedIds[0], 7);
+    MY_ASSERT_EQ(sortedIds[2], 1);
+
+    // canonical order of cached group fields is the order of their bits
+    MY_ASSERT(std::is_sorted(GROUP_FIELD_NAMES.begin(), GROUP_FIELD_NAMES.end(),
+                             [](const char* a, const char* b) { return strcmp(a, b) < 0; }));
+    MY_ASSERT_EQ(getGroupFieldMask("city"), 2);
+    MY_ASSERT_EQ(getGroupFieldMask("likes"), 0);
+    MY_ASSERT_EQ(CITY_COUNTRY_FIELDS_MASK, parseGroupFieldMask("city,country"));
+    MY_ASSERT_EQ(getRollupFieldMask(parseGroupFieldMask("city,sex")), getGroupFieldMask("country"));
+    MY_ASSERT_EQ(getRollupFieldMask(parseGroupFieldMask("city,country")), 0);
+    MY_ASSERT_EQ(getGroupFieldPosition(parseGroupFieldMask("city,sex,status"), 1 << 7), 2);
+
+    AccountBitmap evenIds(AccountBitmap::getNumWords(200));
+    AccountBitmap smallIds(AccountBitmap::getNumWords(100));
+    for (AccountId id = 0; id <= 200; ++id) {
+        if (id % 2 == 0) {
+            evenIds.set(id);
+        }
+        // ignored, doesn't fit
+        smallIds.set(id);
+    }
+    MY_ASSERT_EQ(AccountBitmap::countIntersection(evenIds, smallIds), 64);
+    AccountBitmap both;
+    MY_ASSERT_EQ(both.assignIntersection(smallIds, evenIds), 64);
+    evenIds.intersect(smallIds);
+    MY_ASSERT_EQ(AccountBitmap::countIntersection(evenIds, evenIds), 64);
+
+    int64_t appliedSum = 0;
+    {
+        BatchApplier<int64_t> applier([&](std::vector<int64_t>& batch) {
+            appliedSum = std::accumulate(batch.begin(), batch.end(), appliedSum);
+        });
+        int64_t epoch = 0;
+        for (int64_t i = 1; i <= 100; ++i) {
+            epoch = applier.push(i);
+        }
+        MY_ASSERT_EQ(epoch, 100);
+        applier.waitApplied(epoch);
+        MY_ASSERT_EQ(appliedSum, 5050);
+        applier.push(1);
+        applier.waitAllApplied();
+        MY_ASSERT_EQ(appliedSum, 5051);
+    }
+
+    EdgeList edges = {{5, 10}, {7, 1}, {5, 20}, {5, 60}};
+    aggregateLikeEdges(edges);
+    MY_ASSERT_EQ(edges.size(), 2);
+    MY_ASSERT_EQ(edges[0].accountId, 7);
+    MY_ASSERT_EQ(edges[1].ts, 30);
+    MY_ASSERT_EQ(edges[1].count, 3);
+    addLikeEdge(edges, 5, 70);
+    addLikeEdge(edges, 6, 1);
+    MY_ASSERT_EQ(edges.size(), 3);
+    MY_ASSERT_EQ(edges[1].accountId, 6);
+    MY_ASSERT_EQ(edges[2].ts, 40);
+    // merged averages are rounded
+    addLikeEdge(edges, 6, 2);
+    MY_ASSERT_EQ(edges[1].ts, 2);
+    // the same likes in any order
+    for (const auto& order : {EdgeList{{5, 3}, {5, 3}, {5, 0}}, EdgeList{{5, 0}, {5, 3}, {5, 3}},
+                              EdgeList{{5, 3}, {9, 1}, {5, 0}, {5, 3}}}) {
+        auto repeated = order;
+        aggregateLikeEdges(repeated);
+        MY_ASSERT_EQ(repeated.back().ts, 2);
+        MY_ASSERT_EQ(repeated.back().count, 3);
+    }
+
+    EpochArray<int32_t> counter;
+    for (int32_t epoch = 0; epoch < 2; ++epoch) {
+        counter.startEpoch();
+        MY_ASSERT(!counter.contains(7));
+        ++counter[7];
+        ++counter[3];
+        ++counter[7];
+        MY_ASSERT_EQ(counter[7], 2);
+        MY_ASSERT_EQ(counter.getTouched().size(), 2);
+    }
+
+    {
+        ScratchPool<std::vector<int32_t>> pool;
+        const std::vector<int32_t>* first = nullptr;
+        {
+            auto scratch = pool.acquire();
+            scratch->push_back(1);
+            first = &*scratch;
+            // taken objects are not shared
+            MY_ASSERT(&*pool.acquire() != first);
+        }
+        auto scratch = pool.acquire();
+        MY_ASSERT_EQ(scratch->size(), 1);
+    }
+
+    {
+        RequestParams joined{{"a", "x&b=y"}};
+        RequestParams separate{{"a", "x"}, {"b", "y"}};
+        MY_ASSERT(QueryCache::getKey("filter", joined) != QueryCache::getKey("filter", separate));
+        RequestParams withQueryId{{"b", "y"}, {"query_id", "1"}, {"a", "x"}};
+        MY_ASSERT_EQ(QueryCache::getKey("filter", withQueryId),
+                     QueryCache::getKey("filter", separate));
+    }
+
+    {
+        ResultVersions versions;
+        ResultCache cache;
+        ResultDependencies dependencies;
+        dependencies.accounts = {3, 1, 3};
+        dependencies.interests = {7};
+        cache.put("a", versions.getWriteSeq(), dependencies, versions, "body");
+        std::string body;
+        MY_ASSERT(cache.get("a", versions, &body));
+        MY_ASSERT_EQ(body, "body");
+        versions.bumpAccount(2);
+        MY_ASSERT(cache.get("a", versions, &body));
+        versions.bumpInterests({8});
+        MY_ASSERT(cache.get("a", versions, &body));
+        versions.bumpInterests({7});
+        MY_ASSERT(!cache.get("a", versions, &body));
+
+        // computed while a write was in progress
+        versions.beginWrite();
+        cache.put("b", versions.getWriteSeq(), dependencies, versions, "body");
+        versions.endWrite();
+        MY_ASSERT(!cache.get("b", versions, &body));
+    }
+
+    {
+        WorkerPool pool(2);
+        std::vector<int64_t> slotSums(pool.numSlots());
+        pool.parallelForSlots(100, [&](int32_t i, int32_t slot) { slotSums[slot] += i; });
+        MY_ASSERT_EQ(std::accumulate(slotSums.begin(), slotSums.end(), int64_t(0)), 4950);
+    }
+
     tests::runIteratorTests();
+    tests::runGroupAggregationMapTests();
 }
@@ -47,9 +47,21 @@ double getGoodLikesSize(int32_t currentSize) {
 // constexpr AccountId MAX_ACCOUNT_ID = 300000;
 constexpr AccountId EMPTY_ACCOUNT_ID = 0;
 
+// number of id ranges full scans are split into to run in parallel
+constexpr int32_t NUM_SCAN_PARTITIONS = 16;
+
+// partition 0 holds the biggest ids
+int32_t getPartitionHighId(int32_t partition) {
+    return std::max(0, MAX_ACCOUNT_ID - partition * (MAX_ACCOUNT_ID / NUM_SCAN_PARTITIONS + 1));
+}
+
 // MACROS:
 #define FOR_EACH_ACCOUNT_ID(id) for (int id = 1; id <= MAX_ACCOUNT_ID; ++id)
 
+// goes from biggest to smallest id
+#define FOR_EACH_ACCOUNT_ID_IN_PARTITION(id, partition)                                        \
+    for (int id = getPartitionHighId(partition); id > getPartitionHighId(partition + 1); --id)
+
 // only to be called in a loop
 #define TRY_GET_CONST_DATA(id, data)            \
     const auto& data = index.accountsArray[id]; \
@@ -91,6 +103,10 @@ constexpr CountryId INVALID_COUNTRY_ID = -1;
 using CityId = int16_t;
 constexpr CityId INVALID_CITY_ID = -1;
 
+using FNameId = int16_t;
+using PhoneCodeId = int16_t;
+using EmailDomainId = int16_t;
+
 constexpr int32_t INVALID_ID = -1;
 
 enum class Status : int8_t {
@@ -204,16 +220,74 @@ struct LikeInput {
     Timestamp ts;
 };
 
+// Repeated likes of the same account are aggregated into a single edge with their average ts.
+// Bit fields keep the edge as small as a plain (id, ts) pair.
 struct LikeEdge {
-    AccountId accountId{INVALID_ID};
-    Timestamp ts{0};
-    LikeEdge() = default;
+    static constexpr int32_t MAX_COUNT = 127;
+
+    AccountId accountId : 24;
+    // number of aggregated likes, saturated at MAX_COUNT
+    int32_t count : 8;
+    Timestamp ts;
 
-    LikeEdge(AccountId accountId_, Timestamp ts_) : accountId(accountId_), ts(ts_) {}
+    LikeEdge() : accountId(INVALID_ID), count(1), ts(0) {}
+
+    LikeEdge(AccountId accountId_, Timestamp ts_, int32_t count_ = 1)
+        : accountId(accountId_), count(count_), ts(ts_) {}
+
+    static Timestamp getAverageTs(int64_t sumTs, int64_t count) {
+        return static_cast<Timestamp>(std::llround(static_cast<double>(sumTs) / count));
+    }
+
+    // Adds likes to the already aggregated ones (e.g. new likes after the load).
+    // Every merge rounds the average, and the count saturates, so after MAX_COUNT likes
+    // new ones get more weight than they should: the average drifts towards recent likes.
+    void merge(Timestamp otherTs, int32_t otherCount) {
+        int64_t total = count + otherCount;
+        ts = getAverageTs(static_cast<int64_t>(ts) * count +
+                              static_cast<int64_t>(otherTs) * otherCount,
+                          total);
+        count = std::min<int64_t>(total, MAX_COUNT);
+    }
 };
+static_assert(sizeof(LikeEdge) == 8);
+static_assert(MAX_ACCOUNT_ID < (1 << 23));
 
 using EdgeList = std::vector<LikeEdge>;
 
+// edge lists are sorted by ids in reverse order, one edge per id
+
+void aggregateLikeEdges(EdgeList& edges) {
+    std::sort(edges.begin(), edges.end(), [](const LikeEdge& a, const LikeEdge& b) {
+        return a.accountId > b.accountId;
+    });
+    // the average of every run of the same id is taken at once, so it doesn't depend on the order
+    int32_t size = 0;
+    for (int32_t begin = 0, end = 0; begin < edges.size(); begin = end) {
+        int64_t sumTs = 0;
+        int64_t count = 0;
+        for (end = begin; end < edges.size() && edges[end].accountId == edges[begin].accountId;
+             ++end) {
+            sumTs += static_cast<int64_t>(edges[end].ts) * edges[end].count;
+            count += edges[end].count;
+        }
+        edges[size++] = LikeEdge(edges[begin].accountId, LikeEdge::getAverageTs(sumTs, count),
+                                 std::min<int64_t>(count, LikeEdge::MAX_COUNT));
+    }
+    edges.resize(size);
+}
+
+void addLikeEdge(EdgeList& edges, AccountId accountId, Timestamp ts, int32_t count = 1) {
+    auto it = std::lower_bound(
+        edges.begin(), edges.end(), accountId,
+        [](const LikeEdge& edge, AccountId accountId) { return edge.accountId > accountId; });
+    if (it != edges.end() && it->accountId == accountId) {
+        it->merge(ts, count);
+    } else {
+        edges.emplace(it, accountId, ts, count);
+    }
+}
+
 struct AccountData {
     AccountId id{EMPTY_ACCOUNT_ID};
 
@@ -248,7 +322,9 @@ struct AccountData {
     CountryId countryId{INVALID_COUNTRY_ID};
     CityId cityId{INVALID_CITY_ID};
     SexEnum sexEnum{SexEnum::MALE};
-    std::string emailDomain;
+    FNameId fnameId{INVALID_ID};
+    PhoneCodeId phoneCodeId{INVALID_ID};
+    EmailDomainId emailDomainId{INVALID_ID};
 
     void toJson(json& j) const {
         // toJson(j["likes"], likes);
@@ -325,9 +401,95 @@ struct CompatibilityInput {
     }
 };
 
+// Values indexed by account id that are reused by queries running on the same thread.
+// A value is only valid if its epoch is the current one, so a new query starts in O(1)
+// instead of clearing the whole array.
+template <class T>
+class EpochArray {
+   public:
+    // forgets all values
+    void startEpoch() {
+        if (_values.empty()) {
+            _values.resize(MAX_ACCOUNT_ID + 1);
+            _epochs.resize(MAX_ACCOUNT_ID + 1);
+        }
+        if (++_epoch == 0) {
+            std::fill(_epochs.begin(), _epochs.end(), 0);
+            _epoch = 1;
+        }
+        _touched.clear();
+    }
+
+    bool contains(AccountId id) const { return _epochs[id] == _epoch; }
+
+    // default value if the id wasn't touched since startEpoch
+    T& operator[](AccountId id) {
+        if (_epochs[id] != _epoch) {
+            _epochs[id] = _epoch;
+            _values[id] = T();
+            _touched.push_back(id);
+        }
+        return _values[id];
+    }
+
+    // touched ids in the order of first access
+    const std::vector<AccountId>& getTouched() const { return _touched; }
+
+   private:
+    std::vector<T> _values;
+    std::vector<uint32_t> _epochs;
+    uint32_t _epoch{0};
+    std::vector<AccountId> _touched;
+};
+
+// Objects reused by requests instead of keeping one per server thread: at most
+// NUM_CONCURRENT_REQUESTS requests run at once, so only as many objects are ever created.
+template <class T>
+class ScratchPool {
+   public:
+    // gives the object back to the pool when destroyed
+    class Handle {
+       public:
+        Handle(ScratchPool* pool, std::unique_ptr<T> value)
+            : _pool(pool), _value(std::move(value)) {}
+        Handle(const Handle&) = delete;
+        Handle& operator=(const Handle&) = delete;
+        ~Handle() { _pool->release(std::move(_value)); }
+
+        T& operator*() const { return *_value; }
+        T* operator->() const { return _value.get(); }
+
+       private:
+        ScratchPool* _pool;
+        std::unique_ptr<T> _value;
+    };
+
+    Handle acquire() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_free.empty()) {
+            return Handle(this, std::make_unique<T>());
+        }
+        auto value = std::move(_free.back());
+        _free.pop_back();
+        return Handle(this, std::move(value));
+    }
+
+   private:
+    void release(std::unique_ptr<T> value) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _free.push_back(std::move(value));
+    }
+
+    std::mutex _mutex;
+    std::vector<std::unique_ptr<T>> _free;
+};
+
 using InterestIdMap = IdValueMap<InterestId, std::string>;
 using CountryIdMap = IdValueMap<CountryId, std::string>;
 using CityIdMap = IdValueMap<CityId, std::string>;
+using FNameIdMap = IdValueMap<FNameId, std::string>;
+using PhoneCodeIdMap = IdValueMap<PhoneCodeId, std::string>;
+using EmailDomainIdMap = IdValueMap<EmailDomainId, std::string>;
 
 // TODO: switch to int32_t
 // using GroupKey2D = std::pair<std::string, std::string>;
@@ -342,9 +504,74 @@ enum class GroupFieldType : int8_t {
     COUNTRY = 3,
     CITY = 4,
     FAKE = 5,
+    // premium now, only used as a breakdown for group filter
+    PREMIUM = 6,
 };
 // clang-format: on
 
+// Every field of cached groups has its own bit, so a set of fields is a mask.
+// Bits follow alphabetical order of names: sorting fields by bits gives their canonical order.
+using GroupFieldMask = uint32_t;
+constexpr int32_t NUM_GROUP_FIELD_BITS = 8;
+constexpr std::array<const char*, NUM_GROUP_FIELD_BITS> GROUP_FIELD_NAMES = {
+    "birth", "city", "country", "interests", "joined", "premium", "sex", "status"};
+
+// 0 for fields that aren't part of any cached group (e.g. likes)
+GroupFieldMask getGroupFieldMask(const std::string& name) {
+    for (int32_t bit = 0; bit < NUM_GROUP_FIELD_BITS; ++bit) {
+        if (name == GROUP_FIELD_NAMES[bit]) {
+            return GroupFieldMask(1) << bit;
+        }
+    }
+    return 0;
+}
+
+// ordered list of fields as a number (e.g. keys=city,sex and keys=sex,city differ)
+int32_t appendGroupFieldOrder(int32_t order, GroupFieldMask fieldMask) {
+    return order * (NUM_GROUP_FIELD_BITS + 1) + __builtin_ctz(fieldMask) + 1;
+}
+
+// e.g. "city,sex", returns 0 if one of the names is not a group field
+GroupFieldMask parseGroupFieldMask(const std::string& names) {
+    GroupFieldMask result = 0;
+    for (const auto& name : splitString(names, ',')) {
+        auto fieldMask = getGroupFieldMask(name);
+        if (!fieldMask) {
+            return 0;
+        }
+        result |= fieldMask;
+    }
+    return result;
+}
+
+// position of the field among fields of the mask
+int32_t getGroupFieldPosition(GroupFieldMask mask, GroupFieldMask fieldMask) {
+    return __builtin_popcount(mask & (fieldMask - 1));
+}
+
+// Every city is in a single country, so a cube with both city and country takes about as much
+// as the one with city only. Cubes with just one of them are summed up from it instead.
+constexpr GroupFieldMask CITY_COUNTRY_FIELDS_MASK = 0b110;
+
+// the field to sum up the cube of the mask over, 0 if it can't be rolled up
+GroupFieldMask getRollupFieldMask(GroupFieldMask mask) {
+    auto cityCountry = mask & CITY_COUNTRY_FIELDS_MASK;
+    if (!cityCountry || cityCountry == CITY_COUNTRY_FIELDS_MASK) {
+        return 0;
+    }
+    return CITY_COUNTRY_FIELDS_MASK ^ cityCountry;
+}
+
+std::string getGroupFieldNames(GroupFieldMask mask) {
+    std::string result;
+    for (int32_t bit = 0; bit < NUM_GROUP_FIELD_BITS; ++bit) {
+        if (mask & (GroupFieldMask(1) << bit)) {
+            result += (result.empty() ? "" : ",") + std::string(GROUP_FIELD_NAMES[bit]);
+        }
+    }
+    return result;
+}
+
 struct GroupValue {
     int32_t valueId;
     // type is used to re-construct stringValue of field back from valueId
@@ -355,34 +582,330 @@ struct GroupValue {
     explicit GroupValue(int32_t valueId_, GroupFieldType type_) : valueId(valueId_), type(type_) {}
 };
 
-struct GroupAggregationItem {
-    std::vector<GroupValue> groupValues;
-    int32_t count{1};
+// Group values of all fields are packed into a single mixed-radix integer.
+// Radix of each field covers the whole range of its value ids, so keys stay valid
+// when new cities / countries appear after load.
+using GroupKey = uint64_t;
+
+int32_t getGroupFieldRadix(GroupFieldType type) {
+    switch (type) {
+        case GroupFieldType::SEX:
+            return SEX_CNT;
+        case GroupFieldType::STATUS:
+            return STATUS_CNT;
+        case GroupFieldType::INTERESTS:
+            return std::numeric_limits<InterestId>::max() + 1;
+        case GroupFieldType::COUNTRY:
+            return std::numeric_limits<CountryId>::max() + 1;
+        case GroupFieldType::CITY:
+            return std::numeric_limits<CityId>::max() + 1;
+        case GroupFieldType::FAKE:
+            // years, could be negative
+            return 1 << (8 * sizeof(YearShort));
+        case GroupFieldType::PREMIUM:
+            return PREMIUM_CNT;
+        default:
+            MY_ASSERT(false);
+    }
+}
+
+int32_t getGroupFieldOffset(GroupFieldType type) {
+    if (type == GroupFieldType::FAKE) {
+        return -std::numeric_limits<YearShort>::min();
+    }
+    return 0;
+}
+
+GroupKey appendGroupValue(GroupKey key, const GroupValue& value) {
+    auto digit = value.valueId + getGroupFieldOffset(value.type);
+    MY_ASSERT(0 <= digit && digit < getGroupFieldRadix(value.type));
+    return key * getGroupFieldRadix(value.type) + digit;
+}
+
+// Aggregated counts keyed by GroupKey.
+// Small key spaces (e.g. sex,status,country) are stored as a flat array of counts.
+// Bigger ones are split into blocks of consecutive keys (last field changes fastest),
+// only blocks with at least one group are allocated and found via open addressing table.
+// Either way adding an account updates a single counter in place.
+class GroupAggregationMap {
+   public:
+    // key spaces up to that size are stored in flat array
+    static constexpr GroupKey MAX_FLAT_KEY_SPACE = 1 << 16;
+    static constexpr int32_t BLOCK_BITS = 8;
+    static constexpr int32_t BLOCK_SIZE = 1 << BLOCK_BITS;
+    static constexpr int32_t EMPTY_COUNT = std::numeric_limits<int32_t>::min();
+    static constexpr GroupKey EMPTY_BLOCK = std::numeric_limits<GroupKey>::max();
+    static constexpr int32_t INITIAL_CAPACITY = 16;
+
+    // types of the fields in the order they are packed into the key
+    void init(const std::vector<GroupFieldType>& types) {
+        _types = types;
+        _keySpace = 1;
+        for (auto type : _types) {
+            _keySpace *= getGroupFieldRadix(type);
+        }
+        _size = 0;
+        _numBlocks = 0;
+        _blockIds.clear();
+        _blockOffsets.clear();
+        _counts.clear();
+        if (isFlat()) {
+            _counts.resize(_keySpace, EMPTY_COUNT);
+        } else {
+            _blockIds.resize(INITIAL_CAPACITY, EMPTY_BLOCK);
+            _blockOffsets.resize(INITIAL_CAPACITY);
+        }
+    }
+
+    const std::vector<GroupFieldType>& getTypes() const { return _types; }
+
+    int32_t size() const { return _size; }
+
+    // nullptr if key is missing, invalidated by insert
+    int32_t* find(GroupKey key) {
+        int32_t* cell = nullptr;
+        if (isFlat()) {
+            cell = &_counts[key];
+        } else {
+            auto slot = findSlot(key >> BLOCK_BITS);
+            if (_blockIds[slot] == EMPTY_BLOCK) {
+                return nullptr;
+            }
+            cell = &_counts[_blockOffsets[slot] + (key & (BLOCK_SIZE - 1))];
+        }
+        return *cell == EMPTY_COUNT ? nullptr : cell;
+    }
+
+    // key should be missing
+    void insert(GroupKey key, int32_t count) {
+        ++_size;
+        if (isFlat()) {
+            _counts[key] = count;
+            return;
+        }
+        auto blockId = key >> BLOCK_BITS;
+        auto slot = findSlot(blockId);
+        if (_blockIds[slot] == EMPTY_BLOCK) {
+            if (2 * (_numBlocks + 1) > _blockIds.size()) {
+                rehash(2 * _blockIds.size());
+                slot = findSlot(blockId);
+            }
+            ++_numBlocks;
+            _blockIds[slot] = blockId;
+            _blockOffsets[slot] = _counts.size();
+            _counts.resize(_counts.size() + BLOCK_SIZE, EMPTY_COUNT);
+        }
+        _counts[_blockOffsets[slot] + (key & (BLOCK_SIZE - 1))] = count;
+    }
 
-    // key is used when storing into hash_map
-    std::string key;
+    // returns new count of the key
+    int32_t add(GroupKey key, int32_t delta) {
+        auto countPtr = find(key);
+        if (countPtr) {
+            *countPtr += delta;
+            return *countPtr;
+        }
+        // we set new items only when delta is positive
+        MY_ASSERT(delta > 0);
+        insert(key, delta);
+        return delta;
+    }
 
-    const std::string& getKey() const { return key; }
+    // f(GroupKey key, int32_t count)
+    template <class Function>
+    void forEach(Function&& f) const {
+        if (isFlat()) {
+            forEachInRange(0, 0, _keySpace, f);
+        } else {
+            for (int32_t slot = 0; slot < _blockIds.size(); ++slot) {
+                if (_blockIds[slot] != EMPTY_BLOCK) {
+                    forEachInRange(_blockIds[slot] << BLOCK_BITS, _blockOffsets[slot],
+                                   BLOCK_SIZE, f);
+                }
+            }
+        }
+    }
 
-    GroupAggregationItem() = default;
+    // value of the field at given position in the key
+    GroupValue getValue(GroupKey key, int32_t position) const {
+        for (int32_t i = _types.size() - 1; i > position; --i) {
+            key /= getGroupFieldRadix(_types[i]);
+        }
+        auto type = _types[position];
+        auto digit = static_cast<int32_t>(key % getGroupFieldRadix(type));
+        return GroupValue{digit - getGroupFieldOffset(type), type};
+    }
 
-    GroupAggregationItem(const GroupAggregationItem& prev, const GroupValue& value) {
-        groupValues.reserve(prev.groupValues.size() + 1);
-        groupValues.insert(groupValues.end(), prev.groupValues.begin(), prev.groupValues.end());
-        groupValues.push_back(value);
+    // key without the field at given position (in the map of remaining types)
+    GroupKey removeValue(GroupKey key, int32_t position) const {
+        GroupKey lowerSpace = 1;
+        for (int32_t i = _types.size() - 1; i > position; --i) {
+            lowerSpace *= getGroupFieldRadix(_types[i]);
+        }
+        auto higherKey = key / lowerSpace / getGroupFieldRadix(_types[position]);
+        return higherKey * lowerSpace + key % lowerSpace;
+    }
 
-        key = prev.key + "," + value.getKey();
+    // approximate size of the allocated memory
+    size_t getMemoryUsage() const {
+        return _counts.capacity() * sizeof(int32_t) + _blockIds.capacity() * sizeof(GroupKey) +
+               _blockOffsets.capacity() * sizeof(int32_t);
     }
+
+   private:
+    bool isFlat() const { return _keySpace <= MAX_FLAT_KEY_SPACE; }
+
+    template <class Function>
+    void forEachInRange(GroupKey firstKey, int32_t offset, int32_t length, Function& f) const {
+        for (int32_t i = 0; i < length; ++i) {
+            auto count = _counts[offset + i];
+            if (count != EMPTY_COUNT) {
+                f(firstKey + i, count);
+            }
+        }
+    }
+
+    // slot with the block or empty slot where it should be inserted
+    int32_t findSlot(GroupKey blockId) const {
+        int32_t mask = _blockIds.size() - 1;
+        // fibonacci hashing
+        int32_t slot = static_cast<int32_t>((blockId * 11400714819323198485ull) >> 32) & mask;
+        while (_blockIds[slot] != EMPTY_BLOCK && _blockIds[slot] != blockId) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    // blocks themselves are not moved
+    void rehash(int32_t capacity) {
+        std::vector<GroupKey> blockIds(capacity, EMPTY_BLOCK);
+        std::vector<int32_t> blockOffsets(capacity);
+        blockIds.swap(_blockIds);
+        blockOffsets.swap(_blockOffsets);
+        for (int32_t slot = 0; slot < blockIds.size(); ++slot) {
+            if (blockIds[slot] != EMPTY_BLOCK) {
+                auto newSlot = findSlot(blockIds[slot]);
+                _blockIds[newSlot] = blockIds[slot];
+                _blockOffsets[newSlot] = blockOffsets[slot];
+            }
+        }
+    }
+
+    std::vector<GroupFieldType> _types;
+    GroupKey _keySpace{1};
+    int32_t _size{0};
+    // empty in flat mode
+    int32_t _numBlocks{0};
+    std::vector<GroupKey> _blockIds;
+    std::vector<int32_t> _blockOffsets;
+    // all counts in flat mode, allocated blocks otherwise
+    std::vector<int32_t> _counts;
 };
 
-// key is GroupAggregationItem::getKey()
-using GroupAggregationMap = std::unordered_map<std::string, GroupAggregationItem>;
+// Number of accounts having both interests (interest x interest), sliced by sex, status and
+// country of the account, so that group by interests filtered by interest reads a single row.
+// Countries created after init are only counted in the slice of all countries.
+class InterestCooccurrence {
+   public:
+    static constexpr int32_t MAX_INTERESTS = std::numeric_limits<InterestId>::max() + 1;
+
+    void init(int32_t numCountries) {
+        _numCountries = numCountries;
+        // the last country slice is for all countries
+        size_t numRows = static_cast<size_t>(SEX_CNT) * STATUS_CNT * (numCountries + 1);
+        _counts.assign(numRows * MAX_INTERESTS * MAX_INTERESTS, 0);
+    }
+
+    bool isInitialized() const { return !_counts.empty(); }
+
+    void update(const AccountData& data, int32_t delta) {
+        if (!isInitialized()) {
+            return;
+        }
+        auto sexId = static_cast<int32_t>(data.sexEnum);
+        auto statusId = static_cast<int32_t>(data.status);
+        updateSlice(getSlice(sexId, statusId, _numCountries), data, delta);
+        if (0 <= data.countryId && data.countryId < _numCountries) {
+            updateSlice(getSlice(sexId, statusId, data.countryId), data, delta);
+        }
+    }
+
+    // Adds counts of interests of accounts having interestId to row (MAX_INTERESTS items).
+    // INVALID_ID in sexId, statusId or countryId means any value.
+    // Returns false if the country is not covered.
+    bool addRow(int32_t sexId, int32_t statusId, int32_t countryId, InterestId interestId,
+                int32_t* row) const {
+        if (!isInitialized() || interestId < 0 || countryId >= _numCountries) {
+            return false;
+        }
+        if (countryId == INVALID_ID) {
+            countryId = _numCountries;
+        }
+        for (int32_t sex = 0; sex < SEX_CNT; ++sex) {
+            if (sexId != INVALID_ID && sex != sexId) {
+                continue;
+            }
+            for (int32_t status = 0; status < STATUS_CNT; ++status) {
+                if (statusId != INVALID_ID && status != statusId) {
+                    continue;
+                }
+                const int32_t* counts =
+                    _counts.data() + getRowOffset(getSlice(sex, status, countryId), interestId);
+                for (int32_t i = 0; i < MAX_INTERESTS; ++i) {
+                    row[i] += counts[i];
+                }
+            }
+        }
+        return true;
+    }
+
+    size_t getMemoryUsage() const { return _counts.capacity() * sizeof(int32_t); }
+
+   private:
+    int32_t getSlice(int32_t sexId, int32_t statusId, int32_t countryId) const {
+        return (sexId * STATUS_CNT + statusId) * (_numCountries + 1) + countryId;
+    }
+
+    size_t getRowOffset(int32_t slice, InterestId interestId) const {
+        return (static_cast<size_t>(slice) * MAX_INTERESTS + interestId) * MAX_INTERESTS;
+    }
+
+    void updateSlice(int32_t slice, const AccountData& data, int32_t delta) {
+        for (auto x : data.interests) {
+            int32_t* row = _counts.data() + getRowOffset(slice, x);
+            for (auto y : data.interests) {
+                row[y] += delta;
+            }
+        }
+    }
+
+    int32_t _numCountries{0};
+    std::vector<int32_t> _counts;
+};
 
-using CachedGroup = std::unordered_map<std::string, GroupAggregationMap>;
-// using CachedGroup2D = std::unordered_map<std::string, GroupAggregationMap>;
 
 using AccountIdList = std::vector<AccountId>;
 
+void sortAccountIdList(AccountIdList& list) {
+    // sort in reversed order
+    std::sort(list.rbegin(), list.rend());
+}
+
+// keeps list sorted in reversed order, does nothing if id is already there
+void insertAccountId(AccountIdList& list, AccountId id) {
+    auto it = std::lower_bound(list.begin(), list.end(), id, std::greater<AccountId>());
+    if (it == list.end() || *it != id) {
+        list.insert(it, id);
+    }
+}
+
+void eraseAccountId(AccountIdList& list, AccountId id) {
+    auto it = std::lower_bound(list.begin(), list.end(), id, std::greater<AccountId>());
+    if (it != list.end() && *it == id) {
+        list.erase(it);
+    }
+}
+
 void sortAccountIdsInContainer(std::vector<AccountIdList>& container) {
     for (auto& list : container) {
         // sort in reversed order
@@ -398,7 +921,64 @@ void sortAccountIdsInContainer(std::unordered_map<T, AccountIdList>& container)
     }
 }
 
-constexpr int NUM_SUPPORTED_BREAKDOWNS = 3;
+constexpr int NUM_SUPPORTED_BREAKDOWNS = 4;
+
+// One bit per account id, used to count accounts of low cardinality values (e.g. sex, status,
+// country) among matching accounts with word-wide AND + popcount.
+class AccountBitmap {
+   public:
+    static constexpr int32_t BITS_PER_WORD = 64;
+
+    AccountBitmap() = default;
+    explicit AccountBitmap(int32_t numWords) : _words(numWords, 0) {}
+
+    static int32_t getNumWords(AccountId maxId) { return maxId / BITS_PER_WORD + 1; }
+
+    // ids that don't fit are ignored
+    void set(AccountId id) {
+        auto word = id / BITS_PER_WORD;
+        if (word < _words.size()) {
+            _words[word] |= uint64_t(1) << (id % BITS_PER_WORD);
+        }
+    }
+
+    int32_t numWords() const { return _words.size(); }
+    uint64_t* data() { return _words.data(); }
+    const uint64_t* data() const { return _words.data(); }
+
+    // keeps only bits that are set in other as well
+    void intersect(const AccountBitmap& other) {
+        auto size = std::min(_words.size(), other._words.size());
+        for (size_t i = 0; i < size; ++i) {
+            _words[i] &= other._words[i];
+        }
+        std::fill(_words.begin() + size, _words.end(), 0);
+    }
+
+    // stores a & b into this one, returns number of set bits
+    int32_t assignIntersection(const AccountBitmap& a, const AccountBitmap& b) {
+        auto size = std::min(a._words.size(), b._words.size());
+        _words.resize(size);
+        int32_t count = 0;
+        for (size_t i = 0; i < size; ++i) {
+            _words[i] = a._words[i] & b._words[i];
+            count += __builtin_popcountll(_words[i]);
+        }
+        return count;
+    }
+
+    static int32_t countIntersection(const AccountBitmap& a, const AccountBitmap& b) {
+        auto size = std::min(a._words.size(), b._words.size());
+        int32_t count = 0;
+        for (size_t i = 0; i < size; ++i) {
+            count += __builtin_popcountll(a._words[i] & b._words[i]);
+        }
+        return count;
+    }
+
+   private:
+    std::vector<uint64_t> _words;
+};
 
 using UsersAtIntIndex = std::vector<AccountIdList>;
 using UsersAtStringIndex = std::unordered_map<std::string, AccountIdList>;
@@ -423,6 +1003,9 @@ struct IndexStorage {
     InterestIdMap interestIdMap;
     CountryIdMap countryIdMap;
     CityIdMap cityIdMap;
+    FNameIdMap fnameIdMap;
+    PhoneCodeIdMap phoneCodeIdMap;
+    EmailDomainIdMap emailDomainIdMap;
 
     // single value index
     UsersAtIntIndex usersAtInterestId;
@@ -430,10 +1013,31 @@ struct IndexStorage {
     UsersAtStringIndex usersAtCountry;
     UsersAtStringIndex usersAtCity;
     UsersAtStringIndex usersAtSex;
-    UsersAtStringIndex usersAtEmailDomain;
+    UsersAtIntIndex usersAtFNameId;
+    UsersAtIntIndex usersAtPhoneCodeId;
+    UsersAtIntIndex usersAtEmailDomainId;
     std::unordered_map<YearShort, AccountIdList> usersAtJoinedYear;
     std::unordered_map<YearShort, AccountIdList> usersAtBirthYear;
 
+    // same as usersAtSex, usersAtStatus and usersAtCountry (by ids) but as bitmaps,
+    // they cover ids up to bitmapMaxAccountId
+    std::vector<AccountBitmap> bitmapsAtSex;
+    std::vector<AccountBitmap> bitmapsAtStatus;
+    std::vector<AccountBitmap> bitmapsAtCountryId;
+    AccountId bitmapMaxAccountId{0};
+
+    // used to build complement (e.g. NEQ and null) lookups
+    // Only rebuilt like the lists it is complemented with, so these lookups miss accounts created
+    // since the last rebuild. Adding them here alone would put them into every complement
+    // regardless of their values.
+    AccountIdList usersAll;
+    // accounts with non-empty field
+    AccountIdList usersWithFName;
+    AccountIdList usersWithSName;
+    AccountIdList usersWithPhone;
+    AccountIdList usersWithPremium;
+    AccountIdList usersWithPremiumNow;
+
     // both of the following methods apply only to single value index
     void sortAccountIds() {
         sortAccountIdsInContainer(usersAtInterestId);
@@ -441,9 +1045,18 @@ struct IndexStorage {
         sortAccountIdsInContainer(usersAtCountry);
         sortAccountIdsInContainer(usersAtCity);
         sortAccountIdsInContainer(usersAtSex);
-        sortAccountIdsInContainer(usersAtEmailDomain);
+        sortAccountIdsInContainer(usersAtFNameId);
+        sortAccountIdsInContainer(usersAtPhoneCodeId);
+        sortAccountIdsInContainer(usersAtEmailDomainId);
         sortAccountIdsInContainer(usersAtJoinedYear);
         sortAccountIdsInContainer(usersAtBirthYear);
+
+        sortAccountIdList(usersAll);
+        sortAccountIdList(usersWithFName);
+        sortAccountIdList(usersWithSName);
+        sortAccountIdList(usersWithPhone);
+        sortAccountIdList(usersWithPremium);
+        sortAccountIdList(usersWithPremiumNow);
     }
 
     void resetIndexes() {
@@ -456,9 +1069,24 @@ struct IndexStorage {
         usersAtCountry.clear();
         usersAtCity.clear();
         usersAtSex.clear();
-        usersAtEmailDomain.clear();
+
+        // ids created after the last rebuild are missing here
+        usersAtFNameId.clear();
+        usersAtFNameId.resize(fnameIdMap.size());
+        usersAtPhoneCodeId.clear();
+        usersAtPhoneCodeId.resize(phoneCodeIdMap.size());
+        usersAtEmailDomainId.clear();
+        usersAtEmailDomainId.resize(emailDomainIdMap.size());
+
         usersAtJoinedYear.clear();
         usersAtBirthYear.clear();
+
+        usersAll.clear();
+        usersWithFName.clear();
+        usersWithSName.clear();
+        usersWithPhone.clear();
+        usersWithPremium.clear();
+        usersWithPremiumNow.clear();
     }
 
     // for recommend API
@@ -466,31 +1094,13 @@ struct IndexStorage {
     // 2 * 2 * 3 * 90
     RecommendBuckets recommendBuckets;
 
-    // precomputed group results
-    CachedGroup cachedGroup1D;
-    CachedGroup cachedGroup2D;
-    CachedGroup cachedGroup3D;
-    // CachedGroup cachedGroup4D;
-
-    CachedGroup& getCachedGroup(int size) {
-        if (size == 1) {
-            return cachedGroup1D;
-        } else if (size == 2) {
-            return cachedGroup2D;
-        } else if (size == 3) {
-            return cachedGroup3D;
-        } else {
-            MY_ASSERT(false);
-        }
-    }
+    // precomputed group results by mask of their fields
+    std::array<std::unique_ptr<GroupAggregationMap>, 1 << NUM_GROUP_FIELD_BITS> cachedGroups;
+    // keys=interests filtered by interest (and optionally by sex, status, country)
+    InterestCooccurrence interestCooccurrence;
 
-    GroupAggregationMap* getCachedGroupResult(const std::string& cacheKey, int size) {
-        if (size > 3) {
-            // only up to 3D breakdowns are supported
-            return nullptr;
-        }
-        auto& cachedGroup = getCachedGroup(size);
-        return stl::mapGetPtr(cachedGroup, cacheKey);
+    GroupAggregationMap* getCachedGroupResult(GroupFieldMask fieldsMask) {
+        return cachedGroups[fieldsMask].get();
     }
 
     // validation only
@@ -514,24 +1124,96 @@ std::string getStringValue(const GroupValue& groupValue, const IndexStorage& ind
     }
 }
 
+// ranks of sex / status values, same meaning as in IdValueMap::buildRanks
+std::vector<int32_t> computeEnumRanks(GroupFieldType type) {
+    std::vector<std::string> values;
+    for (int32_t valueId = 0; valueId < getGroupFieldRadix(type); ++valueId) {
+        if (type == GroupFieldType::SEX) {
+            values.push_back(convertSexToString(static_cast<SexEnum>(valueId)));
+        } else {
+            values.push_back(convertStatusToString(static_cast<Status>(valueId)));
+        }
+    }
+    std::vector<int32_t> ranks(values.size(), 0);
+    for (int32_t i = 0; i < values.size(); ++i) {
+        for (const auto& other : values) {
+            if (other < values[i]) {
+                ++ranks[i];
+            }
+        }
+    }
+    return ranks;
+}
+
+// returns false if value doesn't have rank yet
+bool getGroupValueRank(const GroupValue& groupValue, const IndexStorage& index, int32_t* rank) {
+    static const auto sexRanks = computeEnumRanks(GroupFieldType::SEX);
+    static const auto statusRanks = computeEnumRanks(GroupFieldType::STATUS);
+    switch (groupValue.type) {
+        case GroupFieldType::SEX:
+            *rank = sexRanks[groupValue.valueId];
+            return true;
+        case GroupFieldType::STATUS:
+            *rank = statusRanks[groupValue.valueId];
+            return true;
+        case GroupFieldType::INTERESTS:
+            return index.interestIdMap.getRank(groupValue.valueId, rank);
+        case GroupFieldType::CITY:
+            return index.cityIdMap.getRank(groupValue.valueId, rank);
+        case GroupFieldType::COUNTRY:
+            return index.countryIdMap.getRank(groupValue.valueId, rank);
+        default:
+            MY_ASSERT(false);
+    }
+}
+
+constexpr int32_t MAX_GROUP_KEYS = 5;
+
+// Same order as GroupSortingItem, but compares ranks of the values instead of strings
+struct GroupRankedItem {
+    int32_t count;
+    GroupKey key;
+    std::array<int32_t, MAX_GROUP_KEYS> ranks{};
+
+    GroupRankedItem(GroupKey key_, int32_t count_) : count(count_), key(key_) {}
+
+    // positions - where the fields of the original order are in the key of map
+    bool fillRanks(const GroupAggregationMap& map, const std::vector<int32_t>& positions,
+                   const IndexStorage& index) {
+        MY_ASSERT(positions.size() <= MAX_GROUP_KEYS);
+        for (int32_t i = 0; i < positions.size(); ++i) {
+            if (!getGroupValueRank(map.getValue(key, positions[i]), index, &ranks[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool operator<(const GroupRankedItem& other) const {
+        return std::tie(count, ranks) < std::tie(other.count, other.ranks);
+    }
+};
+
 struct GroupSortingItem {
     //  this should be in the right order to be sorted correctly
     std::vector<std::string> fieldValues;
     int32_t count;
 
-    // item - to extract values from
+    // key, map - to extract values from
     // order - to know in which order
     // index - to know how to convert id -> string
-    GroupSortingItem(const GroupAggregationItem& item, const std::vector<GroupFieldType>& order,
-                     const IndexStorage& index)
-        : count(item.count) {
+    GroupSortingItem(GroupKey key, int32_t count_, const GroupAggregationMap& map,
+                     const std::vector<GroupFieldType>& order, const IndexStorage& index)
+        : count(count_) {
+        const auto& types = map.getTypes();
         fieldValues.reserve(order.size());
         for (auto groupType : order) {
             bool found = false;
-            for (const auto& groupValue : item.groupValues) {
-                if (groupValue.type == groupType) {
+            for (int32_t position = 0; position < types.size(); ++position) {
+                if (types[position] == groupType) {
                     if (!found) {
-                        fieldValues.emplace_back(getStringValue(groupValue, index));
+                        fieldValues.emplace_back(
+                            getStringValue(map.getValue(key, position), index));
                         found = true;
                     } else {
                         std::cout << "Duplicated field found: " << static_cast<int32_t>(groupType)
@@ -546,7 +1228,6 @@ struct GroupSortingItem {
             }
         }
     }
-
     bool operator<(const GroupSortingItem& other) const {
         return std::tie(count, fieldValues) < std::tie(other.count, other.fieldValues);
     }
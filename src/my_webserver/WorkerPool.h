@@ -0,0 +1,133 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads used to split a single heavy query (e.g. full scan) into parallel tasks.
+// Only one query uses the pool at a time, the others run their tasks on the calling thread.
+class WorkerPool {
+   public:
+    explicit WorkerPool(int numWorkers) {
+        _workers.reserve(numWorkers);
+        for (int i = 0; i < numWorkers; ++i) {
+            // slot 0 is for the calling thread
+            _workers.emplace_back(&WorkerPool::workerLoop, this, i + 1);
+        }
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _wakeUp.notify_all();
+        for (auto& worker : _workers) {
+            worker.join();
+        }
+    }
+
+    // runs task(0), ..., task(numTasks - 1) and returns once all of them are finished
+    // tasks are started in increasing order, calling thread runs tasks as well
+    void parallelFor(int32_t numTasks, const std::function<void(int32_t)>& task) {
+        parallelForSlots(numTasks, [&](int32_t i, int32_t /* slot */) { task(i); });
+    }
+
+    // same as above, task(i, slot) also gets the slot of the thread running it (less than
+    // numSlots()), so that tasks can accumulate into per-thread partial results
+    void parallelForSlots(int32_t numTasks, const std::function<void(int32_t, int32_t)>& task) {
+        std::unique_lock<std::mutex> busy(_busyMutex, std::try_to_lock);
+        if (!busy.owns_lock() || _workers.empty()) {
+            for (int32_t i = 0; i < numTasks; ++i) {
+                task(i, 0);
+            }
+            return;
+        }
+
+        Job job(&task, numTasks);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _job = &job;
+            ++_generation;
+        }
+        _wakeUp.notify_all();
+
+        job.run(0);
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _jobDone.wait(lock, [&] { return job.finished == numTasks && job.activeWorkers == 0; });
+        _job = nullptr;
+    }
+
+    int size() const { return _workers.size(); }
+
+    int numSlots() const { return _workers.size() + 1; }
+
+   private:
+    struct Job {
+        const std::function<void(int32_t, int32_t)>* task;
+        int32_t numTasks;
+        std::atomic<int32_t> nextTask{0};
+        std::atomic<int32_t> finished{0};
+        // guarded by WorkerPool::_mutex
+        int32_t activeWorkers{0};
+
+        Job(const std::function<void(int32_t, int32_t)>* task_, int32_t numTasks_)
+            : task(task_), numTasks(numTasks_) {}
+
+        void run(int32_t slot) {
+            while (true) {
+                int32_t i = nextTask++;
+                if (i >= numTasks) {
+                    return;
+                }
+                (*task)(i, slot);
+                ++finished;
+            }
+        }
+    };
+
+    void workerLoop(int32_t slot) {
+        int64_t seenGeneration = 0;
+        while (true) {
+            Job* job = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _wakeUp.wait(lock, [&] {
+                    return _stopping || (_job != nullptr && _generation != seenGeneration);
+                });
+                if (_stopping) {
+                    return;
+                }
+                seenGeneration = _generation;
+                job = _job;
+                ++job->activeWorkers;
+            }
+
+            job->run(slot);
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                --job->activeWorkers;
+            }
+            _jobDone.notify_all();
+        }
+    }
+
+    std::vector<std::thread> _workers;
+
+    std::mutex _busyMutex;
+
+    std::mutex _mutex;
+    std::condition_variable _wakeUp;
+    std::condition_variable _jobDone;
+    Job* _job{nullptr};
+    int64_t _generation{0};
+    bool _stopping{false};
+};
@@ -66,9 +66,37 @@ def analyze_group_breakdowns(mode):
     for key, cnt in stats.items():
         print cnt, '\t', key
 
+# prints group profile read by the server on start (see GROUP_PROFILE_FILE)
+def print_group_profile():
+    stats = defaultdict(int)
+    group_fields = ["sex", "status", "interests", "city", "country", "birth", "joined", "premium"]
+    for l in sys.stdin:
+        parts = l.split()
+        q = parts[6]
+        code = int(parts[7])
+        if code != 200 or not q.startswith("/accounts/group/"):
+            continue
+        kv = q.split('?')[1].split('&')
+        fields = set()
+        for item in kv:
+            key, value = item.split('=')
+            if key in ["limit", "query_id", "order"]:
+                continue
+            if key == "keys":
+                fields.update(value.replace("%2C", ",").split(','))
+            else:
+                fields.add(key)
+        if all(field in group_fields for field in fields):
+            stats[",".join(sorted(fields))] += 1
+
+    for key, cnt in sorted(stats.items(), key=lambda kv: -kv[1]):
+        print "{}\t{}".format(cnt, key)
+
 
 if mode == "k" or mode == "v":
     count_query_item_freq(mode)
+elif mode == "p":
+    print_group_profile()
 else:
     analyze_group_breakdowns(mode)
 